@@ -0,0 +1,140 @@
+// Compares the fixed-size packed pattern kernels (N = 2, 3) against the
+// generic ones they replace. Both are called through the same function
+// pointers generate_patterns uses, on the same random patterns, so the
+// difference is only what fixing the size at compile time buys. The
+// kernels only run while a model is compiled, never while solving. Timings
+// on a busy machine vary a lot from run to run, so each is the fastest of
+// N_REPEATS.
+//
+// Built against wave.c compiled with _UNIT_TEST, which exposes the kernels.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "wave.h"
+
+#define INDEX_BITS 3        // up to 8 colours
+#define N_PATTERNS 4096
+#define N_ROUNDS   200
+#define N_REPEATS  21
+
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+
+// Nanoseconds per call of each kernel over every pattern, N_ROUNDS times.
+// The results are folded into sink so the calls can't be dropped.
+static void
+time_kernels(const KeyLayout *layout, const uint8_t *values, const uint64_t *keys,
+             double ns[3], uint64_t *sink)
+{
+    const size_t n_values = layout->pattern_size * layout->pattern_size;
+    const size_t n_calls = (size_t)N_PATTERNS * N_ROUNDS;
+    uint8_t unpacked[16];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < N_ROUNDS; ++round)
+        for (size_t i = 0; i < N_PATTERNS; ++i)
+            *sink += layout->kernels->pack(layout, values + i * n_values);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns[0] = elapsed_ns(&start, &end) / n_calls;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < N_ROUNDS; ++round)
+        for (size_t i = 0; i < N_PATTERNS; ++i)
+            *sink += layout->kernels->rotate(layout, keys[i]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns[1] = elapsed_ns(&start, &end) / n_calls;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < N_ROUNDS; ++round) {
+        for (size_t i = 0; i < N_PATTERNS; ++i) {
+            layout->kernels->unpack(layout, keys[i], unpacked);
+            *sink += unpacked[i % n_values];
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns[2] = elapsed_ns(&start, &end) / n_calls;
+}
+
+
+// The fastest of N_REPEATS timings for each kernel, the generic and fixed
+// sets taking turns so that both see the same drift in clock speed
+static void
+time_best(const KeyLayout *generic, const KeyLayout *fixed, const uint8_t *values, const uint64_t *keys,
+          double generic_ns[3], double fixed_ns[3], uint64_t *sink)
+{
+    for (int k = 0; k < 3; ++k)
+        generic_ns[k] = fixed_ns[k] = 1e30;
+
+    for (int repeat = 0; repeat < N_REPEATS; ++repeat) {
+        double ns[3];
+        time_kernels(generic, values, keys, ns, sink);
+        for (int k = 0; k < 3; ++k)
+            generic_ns[k] = ns[k] < generic_ns[k] ? ns[k] : generic_ns[k];
+        time_kernels(fixed, values, keys, ns, sink);
+        for (int k = 0; k < 3; ++k)
+            fixed_ns[k] = ns[k] < fixed_ns[k] ? ns[k] : fixed_ns[k];
+    }
+}
+
+
+int main(void)
+{
+    static const char *kernel_names[] = {"pack", "rotate", "unpack"};
+    uint64_t sink = 0;
+    int failed = 0;
+
+    srand(1);
+    printf("   N   kernel     generic ns   fixed ns   speedup\n");
+
+    for (unsigned int pattern_size = 2; pattern_size <= 3; ++pattern_size) {
+        const size_t n_values = pattern_size * pattern_size;
+        uint8_t *values = malloc(N_PATTERNS * n_values);
+        uint64_t *keys = malloc(N_PATTERNS * sizeof(uint64_t));
+        KeyLayout fixed, generic;
+
+        if (values == NULL || keys == NULL || !key_layout_init(&fixed, pattern_size, INDEX_BITS)) {
+            fprintf(stderr, "setup failed for N = %u\n", pattern_size);
+            return EXIT_FAILURE;
+        }
+        generic = fixed;
+        generic.kernels = &key_kernels_generic;
+
+        for (size_t i = 0; i < N_PATTERNS * n_values; ++i)
+            values[i] = rand() % (1 << INDEX_BITS);
+        for (size_t i = 0; i < N_PATTERNS; ++i) {
+            keys[i] = generic.kernels->pack(&generic, values + i * n_values);
+            // The two paths must agree before their speed means anything
+            if (fixed.kernels->pack(&fixed, values + i * n_values) != keys[i] ||
+                fixed.kernels->rotate(&fixed, keys[i]) != generic.kernels->rotate(&generic, keys[i]))
+                failed = 1;
+        }
+
+        double generic_ns[3], fixed_ns[3];
+        time_best(&generic, &fixed, values, keys, generic_ns, fixed_ns, &sink);
+
+        for (int k = 0; k < 3; ++k)
+            printf("%4u   %-8s %10.2f %10.2f %8.2fx\n", pattern_size, kernel_names[k],
+                   generic_ns[k], fixed_ns[k], generic_ns[k] / fixed_ns[k]);
+
+        free(values);
+        free(keys);
+    }
+
+    printf("\n(checksum %016llx)\n", (unsigned long long)sink);
+    if (failed) {
+        printf("fixed-size and generic kernels DISAGREE\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,174 @@
+// Times run_wfc_algo on square outputs from 32x32 up to 512x512 so that the
+// cost per output cell can be compared across sizes. With worklist-driven
+// propagation the time per cell should stay roughly flat as the grid grows.
+//
+// Generation logs to stdout (and dumps its output grid in debug builds),
+// so stdout is discarded while it runs.
+// The workspace column is the solver state each output size needs.
+//
+// Afterwards the same seeded jobs are run with serial and with parallel
+// (banded) propagation, which must produce identical output; the bench
+// fails if they differ. Cascades on this sample rarely reach the default
+// hand-off size, so the parallel runs hand over much sooner, and the bench
+// also fails if the bands never ran.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wave.h"
+
+#define SAMPLE_SIZE  8
+#define PATTERN_SIZE 2
+#define N_RUNS       3
+
+#define DETERMINISM_SIZE      256
+#define DETERMINISM_THREADS   4
+#define DETERMINISM_THRESHOLD 16
+#define DETERMINISM_N_SEEDS   4
+
+static const uint64_t determinism_seeds[DETERMINISM_N_SEEDS] = {12345, 1, 2, 3};
+
+#define BLACK 0x000000FF
+#define RED   0xFF0000FF
+#define GREEN 0x00FF00FF
+
+
+static double
+elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+
+static int devnull = -1;
+
+
+// Discard stdout, returning a descriptor to restore it with
+static int
+silence_stdout(void)
+{
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    dup2(devnull, STDOUT_FILENO);
+    return saved_stdout;
+}
+
+
+static void
+restore_stdout(int saved_stdout)
+{
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+}
+
+
+static WfcStatus
+timed_generate(const WfcModel *model, const WfcOptions *options, uint32_t *result, double *ms)
+{
+    struct timespec start, end;
+    int saved_stdout = silence_stdout();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    WfcStatus status = wfc_model_generate(model, DETERMINISM_SIZE, DETERMINISM_SIZE, options, result);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    restore_stdout(saved_stdout);
+    *ms = elapsed_ms(&start, &end);
+    return status;
+}
+
+
+int main()
+{
+    uint32_t cells[SAMPLE_SIZE * SAMPLE_SIZE];
+    for (int y = 0; y < SAMPLE_SIZE; ++y)
+        for (int x = 0; x < SAMPLE_SIZE; ++x)
+            cells[y * SAMPLE_SIZE + x] = (x == 3 || y == 5) ? RED : ((x + y) % 5 == 0 ? GREEN : BLACK);
+
+    CellGrid grid = {.cells = cells, .rows = SAMPLE_SIZE, .cols = SAMPLE_SIZE, .changed = false};
+
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    devnull = open("/dev/null", O_WRONLY);
+    if (report == NULL || devnull < 0) {
+        perror("bench_propagation");
+        return EXIT_FAILURE;
+    }
+
+    WfcModel *model;
+    if (wfc_model_compile(&grid, PATTERN_SIZE, &model) != WFC_OK) {
+        fprintf(stderr, "bench_propagation: could not compile the sample\n");
+        return EXIT_FAILURE;
+    }
+    WfcOptions options = {.recovery = WFC_RECOVER_BACKTRACK};
+
+    fprintf(report, "%10s %12s %14s %14s\n", "output", "ms/run", "ns/cell", "workspace MB");
+    for (unsigned int size = 32; size <= 512; size *= 2) {
+        double total_ms = 0;
+
+        for (int run = 0; run < N_RUNS; ++run) {
+            struct timespec start, end;
+            int saved_stdout = silence_stdout();
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            free(run_wfc_algo(&grid, PATTERN_SIZE, size, size));
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            restore_stdout(saved_stdout);
+
+            total_ms += elapsed_ms(&start, &end);
+        }
+
+        double ms_per_run = total_ms / N_RUNS;
+        fprintf(report, "%4ux%-5u %12.2f %14.1f %14.1f\n", size, size, ms_per_run,
+                ms_per_run * 1e6 / ((double)size * size),
+                wfc_workspace_footprint(model, size, size, &options) / 1048576.0);
+        fflush(report);
+    }
+
+    size_t n_pixels = (size_t)DETERMINISM_SIZE * DETERMINISM_SIZE;
+    uint32_t *serial = malloc(n_pixels * sizeof(uint32_t));
+    uint32_t *parallel = malloc(n_pixels * sizeof(uint32_t));
+    bool passed = true;
+
+    fputc('\n', report);
+    for (int i = 0; i < DETERMINISM_N_SEEDS; ++i) {
+        WfcOptions serial_options = {
+            .propagator = WFC_PROPAGATE_BITSET,
+            .recovery = WFC_RECOVER_BACKTRACK,
+            .seed = determinism_seeds[i],
+        };
+        WfcStats parallel_stats = {0};
+        WfcOptions parallel_options = serial_options;
+        parallel_options.propagator = WFC_PROPAGATE_PARALLEL;
+        parallel_options.n_propagation_threads = DETERMINISM_THREADS;
+        parallel_options.parallel_threshold = DETERMINISM_THRESHOLD;
+        parallel_options.stats = &parallel_stats;
+
+        double serial_ms, parallel_ms;
+        WfcStatus serial_status = timed_generate(model, &serial_options, serial, &serial_ms);
+        WfcStatus parallel_status = timed_generate(model, &parallel_options, parallel, &parallel_ms);
+        bool identical = serial_status == parallel_status &&
+                         (serial_status != WFC_OK || memcmp(serial, parallel, n_pixels * sizeof(uint32_t)) == 0);
+        bool banded = parallel_stats.n_parallel_passes > 0;
+        passed = passed && identical && banded;
+
+        fprintf(report, "%ux%u seed %llu: serial %.2f ms, %u bands %.2f ms (%llu parallel passes), %s\n",
+                DETERMINISM_SIZE, DETERMINISM_SIZE, (unsigned long long)determinism_seeds[i], serial_ms,
+                DETERMINISM_THREADS, parallel_ms, (unsigned long long)parallel_stats.n_parallel_passes,
+                !identical ? "OUTPUTS DIFFER" : banded ? "identical" : "BANDS NEVER RAN");
+    }
+
+    free(serial);
+    free(parallel);
+    wfc_model_free(model);
+    close(devnull);
+    fclose(report);
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
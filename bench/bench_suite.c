@@ -0,0 +1,228 @@
+// Regression bench over the sample corpus in bench/samples. Every case
+// compiles one sample and generates from it with a fixed list of seeds, so
+// runs are comparable from build to build; the output hash changes only
+// when the solver's results do.
+//
+// Each case runs in its own child process, so the peak resident memory
+// reported is that case's alone. Results go to stdout as JSON:
+//
+//   {"cases": [{"name": ..., "extract_ms": ..., "rules_ms": ...,
+//               "solve_ms": ..., "propagate_ms": ..., "observe_ms": ...,
+//               "propagations_per_sec": ..., "contradictions": ...,
+//               "parallel_passes": ...,
+//               "peak_rss_kb": ..., ...}, ...]}
+//
+// Usage: bench_suite [samples directory]
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "pictoro.h"
+#include "wave.h"
+
+#define N_SEEDS 5
+
+// Cases with parallel propagation always split the output into this many
+// bands, whatever the machine, and hand cascades to them early enough that
+// the bands do run on these small outputs
+#define BAND_THREADS   4
+#define BAND_THRESHOLD 64
+
+static const uint64_t seeds[N_SEEDS] = {1, 2, 3, 4, 5};
+
+typedef struct BenchCase
+{
+    const char *name;
+    const char *sample;
+    unsigned int pattern_size, symmetry;
+    bool periodic_input;
+    unsigned int output_size;
+    WfcPropagator propagator;
+    unsigned int n_levels;          // coarse to fine over this many levels, 0 to solve the output whole
+} BenchCase;
+
+static const BenchCase cases[] = {
+    {"rooms-n3",         "rooms.ppm",   3, 4, false,  48, WFC_PROPAGATE_BITSET,   0},
+    {"rooms-n3-ac4",     "rooms.ppm",   3, 4, false,  48, WFC_PROPAGATE_AC4,      0},
+    {"lines-n2",         "lines.ppm",   2, 4, false,  96, WFC_PROPAGATE_BITSET,   0},
+    {"lines-n3-bands",   "lines.ppm",   3, 4, false, 128, WFC_PROPAGATE_PARALLEL, 0},
+    {"lines-n3-levels",  "lines.ppm",   3, 4, false, 192, WFC_PROPAGATE_BITSET,   2},
+    {"maze-n3-periodic", "maze.ppm",    3, 8, true,   48, WFC_PROPAGATE_BITSET,   0},
+    {"islands-n3",       "islands.ppm", 3, 1, false,  64, WFC_PROPAGATE_BITSET,   0},
+    {"bricks-n3",        "bricks.ppm",  3, 2, true,   48, WFC_PROPAGATE_BITSET,   0},
+};
+
+// What a child sends back for its case
+typedef struct CaseResult
+{
+    WfcStatus compile_status;
+    WfcStats stats;                 // totals over every seed
+    unsigned int n_failures;
+    uint64_t hash;                  // FNV-1a over every seed's output
+} CaseResult;
+
+
+static const char *
+propagator_name(const WfcPropagator propagator)
+{
+    switch (propagator) {
+        case WFC_PROPAGATE_BITSET:   return "bitset";
+        case WFC_PROPAGATE_AC4:      return "ac4";
+        case WFC_PROPAGATE_PARALLEL: return "parallel";
+        default:                     return "unknown";
+    }
+}
+
+
+static void
+run_case(const BenchCase *bench, const char *directory, CaseResult *result)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", directory, bench->sample);
+
+    p_frame *sample;
+    if (pictoro_load_frame(&sample, path)) {
+        result->compile_status = WFC_IO_ERROR;
+        return;
+    }
+    CellGrid grid = {.cells = sample->pixels, .rows = sample->height, .cols = sample->width};
+
+    WfcOptions options = {
+        .propagator = bench->propagator,
+        .recovery = WFC_RECOVER_BACKTRACK,
+        .symmetry = bench->symmetry,
+        .periodic_input = bench->periodic_input,
+        .stats = &result->stats,
+        .quiet = true,
+    };
+
+    if (bench->propagator == WFC_PROPAGATE_PARALLEL) {
+        options.n_propagation_threads = BAND_THREADS;
+        options.parallel_threshold = BAND_THRESHOLD;
+    }
+
+    // Compiled for coarse to fine cases too, to check the sample up front.
+    // Those build every level's model again for each seed and add up the
+    // compile times, so they report the total over levels and seeds instead.
+    WfcModel *model;
+    result->compile_status = wfc_model_compile_opts(&grid, bench->pattern_size, &options, &model);
+    if (result->compile_status != WFC_OK) {
+        pictoro_free_frame(sample);
+        return;
+    }
+    if (bench->n_levels)
+        result->stats.extract_ms = result->stats.rules_ms = 0;
+
+    const size_t n_pixels = (size_t)bench->output_size * bench->output_size;
+    uint32_t *output = malloc(n_pixels * sizeof(uint32_t));
+    result->hash = 1469598103934665603ull;
+    for (int i = 0; i < N_SEEDS; ++i) {
+        options.seed = seeds[i];
+        WfcStatus status = bench->n_levels
+            ? wfc_generate_hierarchical(&grid, bench->pattern_size, bench->output_size, bench->output_size,
+                                        bench->n_levels, &options, output)
+            : wfc_model_generate(model, bench->output_size, bench->output_size, &options, output);
+        if (status != WFC_OK) {
+            result->n_failures++;
+            continue;
+        }
+        const uint8_t *bytes = (const uint8_t *)output;
+        for (size_t b = 0; b < n_pixels * sizeof(uint32_t); ++b)
+            result->hash = (result->hash ^ bytes[b]) * 1099511628211ull;
+    }
+
+    free(output);
+    wfc_model_free(model);
+    pictoro_free_frame(sample);
+}
+
+
+// Run one case in a child, returning false if it couldn't be run at all
+static bool
+fork_case(const BenchCase *bench, const char *directory, CaseResult *result, long *peak_rss_kb)
+{
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0)
+        return false;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+
+    if (pid == 0) {
+        close(pipe_fds[0]);
+
+        CaseResult child_result = {0};
+        run_case(bench, directory, &child_result);
+        bool written = write(pipe_fds[1], &child_result, sizeof(child_result)) == sizeof(child_result);
+        _exit(written ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(pipe_fds[1]);
+    bool received = read(pipe_fds[0], result, sizeof(*result)) == sizeof(*result);
+    close(pipe_fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        return false;
+    *peak_rss_kb = usage.ru_maxrss;
+    return received;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *directory = argc > 1 ? argv[1] : "bench/samples";
+    const size_t n_cases = sizeof(cases) / sizeof(cases[0]);
+    bool failed = false;
+
+    printf("{\"seeds\": %d, \"cases\": [", N_SEEDS);
+    for (size_t i = 0; i < n_cases; ++i) {
+        const BenchCase *bench = &cases[i];
+        CaseResult result = {0};
+        long peak_rss_kb = 0;
+
+        printf("%s\n  {\"name\": \"%s\", \"sample\": \"%s\", \"pattern_size\": %u, \"symmetry\": %u, "
+               "\"periodic_input\": %s, \"output\": [%u, %u], \"propagator\": \"%s\", \"levels\": %u, ",
+               i ? "," : "", bench->name, bench->sample, bench->pattern_size, bench->symmetry,
+               bench->periodic_input ? "true" : "false", bench->output_size, bench->output_size,
+               propagator_name(bench->propagator), bench->n_levels ? bench->n_levels : 1);
+
+        if (!fork_case(bench, directory, &result, &peak_rss_kb) || result.compile_status != WFC_OK) {
+            printf("\"error\": \"%s\"}",
+                   result.compile_status != WFC_OK ? wfc_status_string(result.compile_status) : "case crashed");
+            failed = true;
+            continue;
+        }
+
+        const WfcStats *stats = &result.stats;
+        double solve_s = stats->solve_ms / 1e3;
+        printf("\"patterns\": %zu, \"rules\": %zu, \"extract_ms\": %.3f, \"rules_ms\": %.3f, "
+               "\"solve_ms\": %.3f, \"propagate_ms\": %.3f, \"observe_ms\": %.3f, "
+               "\"attempts\": %u, \"failures\": %u, \"observations\": %llu, \"propagations\": %llu, "
+               "\"propagations_per_sec\": %.0f, \"cells_visited\": %llu, \"bans\": %llu, "
+               "\"contradictions\": %llu, \"parallel_passes\": %llu, \"workspace_bytes\": %zu, \"peak_rss_kb\": %ld, "
+               "\"output_hash\": \"%016llx\"}",
+               stats->n_patterns, stats->n_rules, stats->extract_ms, stats->rules_ms,
+               stats->solve_ms, stats->propagate_ms, stats->observe_ms,
+               stats->n_attempts, result.n_failures, (unsigned long long)stats->n_observations,
+               (unsigned long long)stats->n_propagations,
+               solve_s > 0 ? stats->n_propagations / solve_s : 0.0,
+               (unsigned long long)stats->n_cells_visited, (unsigned long long)stats->n_bans,
+               (unsigned long long)stats->n_contradictions, (unsigned long long)stats->n_parallel_passes,
+               stats->peak_workspace_bytes, peak_rss_kb,
+               (unsigned long long)result.hash);
+        fflush(stdout);
+    }
+    printf("\n]}\n");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
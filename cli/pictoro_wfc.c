@@ -0,0 +1,215 @@
+// Headless generator: a sample PPM (or a compiled model) in, a generated
+// PPM out, with no display needed. Compile a sample once with -c and pass
+// the model with -m to every later job to skip extraction altogether;
+// models are mapped in place, so start-up stays cheap. For large outputs,
+// -L solves the sample coarse to fine over several levels instead.
+//
+// Exit status is 0 on success, 1 for bad arguments or I/O errors and 2 if
+// generation failed (a contradiction or the time limit).
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pictoro.h"
+#include "wave.h"
+
+#define DEFAULT_PATTERN_SIZE 3
+#define DEFAULT_OUTPUT_SIZE  64
+
+
+static void
+usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [options] input.ppm output.ppm\n"
+            "  -n N       pattern size (default %d)\n"
+            "  -o WxH     output size in pixels (default %dx%d)\n"
+            "  -s SEED    seed; the same seed gives the same output (default: from the clock)\n"
+            "  -t N       threads running attempts side by side (default 1)\n"
+            "  -r N       symmetry: 1, 2, 4 or 8 variants of every sample window (default 4)\n"
+            "  -p         the sample wraps around\n"
+            "  -P         the output wraps around\n"
+            "  -a         AC-4 propagation\n"
+            "  -l MS      give up after MS milliseconds\n"
+            "  -m         input is a model saved with -c rather than a sample\n"
+            "  -c FILE    save the compiled model to FILE as well\n"
+            "  -L N       solve coarse to fine over N levels in patches, -t at a time (not with -m, -c or -P)\n"
+            "  -q         print nothing but errors\n",
+            program, DEFAULT_PATTERN_SIZE, DEFAULT_OUTPUT_SIZE, DEFAULT_OUTPUT_SIZE);
+}
+
+
+static bool
+parse_unsigned(const char *text, unsigned int *value)
+{
+    char *end;
+    unsigned long parsed = strtoul(text, &end, 10);
+    if (end == text || *end != '\0' || parsed > 1u << 20)
+        return false;
+    *value = parsed;
+    return true;
+}
+
+
+// WIDTHxHEIGHT, each side as parse_unsigned takes it and neither 0
+static bool
+parse_size(const char *text, unsigned int *width, unsigned int *height)
+{
+    const char *split = strchr(text, 'x');
+    char first[16];
+    if (split == NULL || (size_t)(split - text) >= sizeof(first))
+        return false;
+    memcpy(first, text, split - text);
+    first[split - text] = '\0';
+    return parse_unsigned(first, width) && parse_unsigned(split + 1, height) && *width > 0 && *height > 0;
+}
+
+
+// Seeds take the whole 64-bit range, so no cap, but a sign or anything
+// past the digits is still an error
+static bool
+parse_seed(const char *text, uint64_t *value)
+{
+    if (*text < '0' || *text > '9')
+        return false;
+    char *end;
+    errno = 0;
+    unsigned long long parsed = strtoull(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE)
+        return false;
+    *value = parsed;
+    return true;
+}
+
+
+// Report how generation went and write the output if it worked, returning
+// the exit status
+static int
+finish(const char *program, const WfcStatus status, const p_frame *output, const char *output_path)
+{
+    if (status != WFC_OK) {
+        fprintf(stderr, "%s: generation failed: %s\n", program, wfc_status_string(status));
+        return status == WFC_CONTRADICTION || status == WFC_TIMEOUT ? 2 : 1;
+    }
+    if (pictoro_save_frame(output, output_path)) {
+        fprintf(stderr, "%s: could not write %s\n", program, output_path);
+        return 1;
+    }
+    return 0;
+}
+
+
+// Coarse to fine generation works from the sample itself, which its
+// coarser levels are made from, so there is no model to compile or load
+static int
+generate_levels(const char *program, const char *input_path, const char *output_path,
+                const unsigned int pattern_size, const unsigned int n_levels, const WfcOptions *options,
+                const unsigned int width, const unsigned int height)
+{
+    p_frame *sample, *output;
+    if (pictoro_load_frame(&sample, input_path)) {
+        fprintf(stderr, "%s: could not read %s as a binary PPM\n", program, input_path);
+        return 1;
+    }
+    if (pictoro_create_frame(&output, width, height)) {
+        fprintf(stderr, "%s: could not allocate a %ux%u output\n", program, width, height);
+        pictoro_free_frame(sample);
+        return 1;
+    }
+
+    CellGrid grid = {.cells = sample->pixels, .rows = sample->height, .cols = sample->width};
+    WfcStatus status = wfc_generate_hierarchical(&grid, pattern_size, width, height, n_levels, options,
+                                                 output->pixels);
+    int exit_status = finish(program, status, output, output_path);
+    pictoro_free_frame(sample);
+    pictoro_free_frame(output);
+    return exit_status;
+}
+
+
+int main(int argc, char **argv)
+{
+    unsigned int pattern_size = DEFAULT_PATTERN_SIZE;
+    unsigned int width = DEFAULT_OUTPUT_SIZE, height = DEFAULT_OUTPUT_SIZE;
+    bool is_model = false;
+    const char *model_path = NULL;
+    unsigned int n_levels = 0;
+    WfcOptions options = {
+        .propagator = WFC_PROPAGATE_BITSET,
+        .recovery = WFC_RECOVER_BACKTRACK,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:o:s:t:r:pPal:mc:L:q")) != -1) {
+        bool valid = true;
+        switch (opt) {
+            case 'n': valid = parse_unsigned(optarg, &pattern_size) && pattern_size > 0; break;
+            case 'o': valid = parse_size(optarg, &width, &height); break;
+            case 's': valid = parse_seed(optarg, &options.seed); break;
+            case 't': valid = parse_unsigned(optarg, &options.n_threads); break;
+            case 'r': valid = parse_unsigned(optarg, &options.symmetry); break;
+            case 'p': options.periodic_input = true; break;
+            case 'P': options.periodic_output = true; break;
+            case 'a': options.propagator = WFC_PROPAGATE_AC4; break;
+            case 'l': valid = parse_unsigned(optarg, &options.time_limit_ms); break;
+            case 'm': is_model = true; break;
+            case 'c': model_path = optarg; break;
+            case 'L': valid = parse_unsigned(optarg, &n_levels) && n_levels > 0; break;
+            case 'q': options.quiet = true; break;
+            default:  valid = false; break;
+        }
+        if (!valid) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2 || (n_levels && (is_model || model_path || options.periodic_output))) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *input_path = argv[optind], *output_path = argv[optind + 1];
+    if (n_levels)
+        return generate_levels(argv[0], input_path, output_path, pattern_size, n_levels, &options, width, height);
+
+    WfcModel *model;
+    WfcStatus status;
+    if (is_model) {
+        status = wfc_model_load(input_path, &model);
+    } else {
+        p_frame *sample;
+        if (pictoro_load_frame(&sample, input_path)) {
+            fprintf(stderr, "%s: could not read %s as a binary PPM\n", argv[0], input_path);
+            return 1;
+        }
+        CellGrid grid = {.cells = sample->pixels, .rows = sample->height, .cols = sample->width};
+        status = wfc_model_compile_opts(&grid, pattern_size, &options, &model);
+        pictoro_free_frame(sample);
+    }
+    if (status != WFC_OK) {
+        fprintf(stderr, "%s: could not %s %s: %s\n", argv[0], is_model ? "load" : "compile",
+                input_path, wfc_status_string(status));
+        return 1;
+    }
+    if (model_path && (status = wfc_model_save(model, model_path)) != WFC_OK) {
+        fprintf(stderr, "%s: could not save the model to %s: %s\n", argv[0], model_path, wfc_status_string(status));
+        wfc_model_free(model);
+        return 1;
+    }
+
+    p_frame *output;
+    if (pictoro_create_frame(&output, width, height)) {
+        fprintf(stderr, "%s: could not allocate a %ux%u output\n", argv[0], width, height);
+        wfc_model_free(model);
+        return 1;
+    }
+
+    int exit_status = finish(argv[0], wfc_model_generate_frame(model, &options, output), output, output_path);
+    pictoro_free_frame(output);
+    wfc_model_free(model);
+    return exit_status;
+}
@@ -0,0 +1,107 @@
+#ifndef _H_BITSET
+#define _H_BITSET
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Packed sets of pattern indices, one bit per pattern in 64-bit words.
+// Bits past the last pattern are always kept at zero so counts stay exact.
+
+#define BITSET_WORD_BITS 64
+
+#define bitset_words(n_bits) (((n_bits) + BITSET_WORD_BITS - 1) / BITSET_WORD_BITS)
+
+
+static inline void
+bitset_set(uint64_t *set, const size_t bit)
+{
+    set[bit / BITSET_WORD_BITS] |= (uint64_t)1 << (bit % BITSET_WORD_BITS);
+}
+
+static inline void
+bitset_clear(uint64_t *set, const size_t bit)
+{
+    set[bit / BITSET_WORD_BITS] &= ~((uint64_t)1 << (bit % BITSET_WORD_BITS));
+}
+
+static inline bool
+bitset_test(const uint64_t *set, const size_t bit)
+{
+    return (set[bit / BITSET_WORD_BITS] >> (bit % BITSET_WORD_BITS)) & 1;
+}
+
+// Set the first n_bits bits and zero the rest of the words
+static inline void
+bitset_fill(uint64_t *set, const size_t n_bits)
+{
+    size_t n_words = bitset_words(n_bits);
+    for (size_t i = 0; i < n_words; ++i)
+        set[i] = ~(uint64_t)0;
+    if (n_bits % BITSET_WORD_BITS)
+        set[n_words - 1] = ((uint64_t)1 << (n_bits % BITSET_WORD_BITS)) - 1;
+}
+
+static inline size_t
+bitset_count(const uint64_t *set, const size_t n_words)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < n_words; ++i)
+        count += __builtin_popcountll(set[i]);
+    return count;
+}
+
+// Index of the lowest set bit, or SIZE_MAX if the set is empty
+static inline size_t
+bitset_first(const uint64_t *set, const size_t n_words)
+{
+    for (size_t i = 0; i < n_words; ++i)
+        if (set[i])
+            return i * BITSET_WORD_BITS + __builtin_ctzll(set[i]);
+    return SIZE_MAX;
+}
+
+// dest |= src
+static inline void
+bitset_or(uint64_t *restrict dest, const uint64_t *restrict src, const size_t n_words)
+{
+    size_t i = 0;
+#ifdef __AVX2__
+    for (; i + 4 <= n_words; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dest + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_or_si256(a, b));
+    }
+#endif
+    for (; i < n_words; ++i)
+        dest[i] |= src[i];
+}
+
+// dest &= src, returning the number of bits left in dest
+static inline size_t
+bitset_and_count(uint64_t *restrict dest, const uint64_t *restrict src, const size_t n_words)
+{
+    size_t count = 0;
+    size_t i = 0;
+#ifdef __AVX2__
+    for (; i + 4 <= n_words; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dest + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_and_si256(a, b));
+        count += __builtin_popcountll(dest[i + 0]) + __builtin_popcountll(dest[i + 1])
+               + __builtin_popcountll(dest[i + 2]) + __builtin_popcountll(dest[i + 3]);
+    }
+#endif
+    for (; i < n_words; ++i) {
+        dest[i] &= src[i];
+        count += __builtin_popcountll(dest[i]);
+    }
+    return count;
+}
+
+
+#endif  // _H_BITSET
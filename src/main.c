@@ -1,4 +1,6 @@
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,6 +17,7 @@
 #define FRAME_TIME_MS 1000.0f / FRAME_RATE
 #define N_CELL_ROWS 8
 #define N_CELL_COLS 8
+#define PATTERN_SIZE 2
 #define BLACK 0x000000FF
 #define WHITE 0xFFFFFFFF
 #define RED   0xFF0000FF
@@ -32,6 +35,18 @@ typedef enum DrawState
 static const uint32_t draw_colors[] = {BLACK, WHITE, RED, GREEN, BLUE};
 
 
+// A generation run on its own thread so the windows keep responding
+typedef struct SolveJob
+{
+    const CellGrid *grid;
+    unsigned int output_width, output_height;
+    WfcOptions options;
+    uint32_t *result;
+    WfcStatus status;
+    atomic_bool done;
+} SolveJob;
+
+
 DrawState draw_state = NORMAL;
 static unsigned int draw_colors_idx = 0;
 static const size_t n_draw_colors = sizeof(draw_colors) / sizeof(uint32_t);
@@ -114,6 +129,30 @@ void draw_grid(p_frame *frame, CellGrid grid, const double cell_width, const dou
 }
 
 
+void *solve_job(void *arg)
+{
+    SolveJob *job = arg;
+    job->status = wfc_generate(job->grid, PATTERN_SIZE, job->output_width, job->output_height,
+                               &job->options, job->result);
+    atomic_store(&job->done, true);
+    return NULL;
+}
+
+
+void draw_output(p_frame *frame, const uint32_t *pixels, const size_t width, const size_t height,
+                 const size_t pixel_size)
+{
+    for (size_t j = 0; j < height; ++j) {
+        for (size_t i = 0; i < width; ++i) {
+            pictoro_fill_rect(frame,
+                              i * pixel_size, j * pixel_size,
+                              pixel_size, pixel_size,
+                              pixels[j * width + i]);
+        }
+    }
+}
+
+
 void draw_mouse(p_frame *frame, p_frame *background, int *old_mouse_x, int *old_mouse_y)
 {
     int mouse_x, mouse_y, delta_x, delta_y;
@@ -238,7 +277,26 @@ int main()
 
     size_t output_p_width = 30;
     size_t output_p_height = 20;
-    uint32_t *result = run_wfc_algo(&cell_grid, 2, output_p_width, output_p_height);
+    uint32_t *result = malloc(output_p_width * output_p_height * sizeof(uint32_t));
+    WfcMonitor *monitor;
+    if (result == NULL || wfc_monitor_create(output_p_width, output_p_height, FRAME_TIME_MS, &monitor) != WFC_OK)
+        error_and_die("Allocate output");
+
+    SolveJob job = {
+        .grid = &cell_grid,
+        .output_width = output_p_width,
+        .output_height = output_p_height,
+        .options = {
+            .propagator = WFC_PROPAGATE_BITSET,
+            .recovery = WFC_RECOVER_BACKTRACK,
+            .monitor = monitor,
+        },
+        .result = result,
+    };
+    atomic_init(&job.done, false);
+    pthread_t solver;
+    if (pthread_create(&solver, NULL, solve_job, &job) != 0)
+        error_and_die("Start solver");
 
 
     size_t output_pixel_size = 50;
@@ -250,7 +308,7 @@ int main()
     pictoro_create_frame(&output_frame, 
                          output_p_width * output_pixel_size, 
                          output_p_height * output_pixel_size);
-    pictoro_fill_frame(frame, BLACK);
+    pictoro_fill_frame(output_frame, BLACK);
 
     SDL_Window *out_window = SDL_CreateWindow("Result", 
                                              SDL_WINDOWPOS_CENTERED, 
@@ -262,21 +320,60 @@ int main()
     SDL_Texture *output_texture = SDL_CreateTexture(output_renderer,
                                                     SDL_PIXELFORMAT_RGBA8888,
                                                     SDL_TEXTUREACCESS_STREAMING,
-                                                    output_win_height, output_win_width);
+                                                    output_win_width, output_win_height);
+
+    // Show the solve as it goes, then the result, until the window is
+    // closed. Closing it (or Escape) while still solving cancels the solve.
+    bool solving = true;
+    run = true;
+    while (run) {
+        uint64_t frame_start = SDL_GetPerformanceCounter();
+
+        if (solving && atomic_load(&job.done)) {
+            solving = false;
+            if (job.status == WFC_OK) {
+                draw_output(output_frame, result, output_p_width, output_p_height, output_pixel_size);
+            } else {
+                logger(ERROR, "Could not generate an output from the sample: %s", wfc_status_string(job.status));
+                pictoro_fill_frame(output_frame, BLACK);
+                output_frame->changed = true;
+            }
+        } else if (solving) {
+            const uint32_t *preview = wfc_monitor_preview(monitor);
+            if (preview)
+                draw_output(output_frame, preview, output_p_width, output_p_height, output_pixel_size);
+        }
 
-    for (size_t i = 0; i < output_p_width; ++i) {
-        for (size_t j = 0; j < output_p_height; ++j) {
-            uint32_t color = result[j * output_p_width + i];
-            printf("filling position (%zu, %zu) with color %u\n", i, j, color);
+        if (output_frame->changed)
+            update_texture(output_frame, output_texture, output_renderer);
 
-            pictoro_fill_rect(output_frame, 
-                              i * output_pixel_size, j * output_pixel_size,
-                              output_pixel_size, output_pixel_size,
-                              color);
+        while(SDL_PollEvent(&e) > 0) {
+            switch(e.type) {
+            case SDL_QUIT: {
+                run = false;
+            }
+            break;
+            case SDL_WINDOWEVENT: {
+                if (e.window.event == SDL_WINDOWEVENT_CLOSE)
+                    run = false;
+            }
+            break;
+            case SDL_KEYDOWN: {
+                if (e.key.keysym.sym == SDLK_ESCAPE)
+                    run = false;
+            }
+            break;
+            }
         }
+        check_time(frame_start);
+    }
+
+    if (solving) {
+        logger(INFO, "Cancelling generation");
+        wfc_monitor_cancel(monitor);
     }
-    update_texture(output_frame, output_texture, output_renderer);
-    SDL_Delay(5000);
+    pthread_join(solver, NULL);
+    wfc_monitor_free(monitor);
 
 
     SDL_DestroyRenderer(renderer);
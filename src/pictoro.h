@@ -3,12 +3,21 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "constants.h"
 #include "logging.h"
 
 #define PPM_HEADER_MAXSIZE 256
+#define PPM_MAX_DIMENSION  16384
 
 
 typedef struct
@@ -19,15 +28,15 @@ typedef struct
 } p_frame;
 
 
-int pictoro_create_frame(p_frame **frame, const int width, const int height)
+static inline int pictoro_create_frame(p_frame **frame, const int width, const int height)
 {
-    uint32_t *pixels = malloc(width * height * sizeof(uint32_t));
+    uint32_t *pixels = malloc((size_t)width * height * sizeof(uint32_t));
     p_frame *result = malloc(sizeof(p_frame));
 
     if (pixels == NULL || result == NULL)
         return 1;
 
-    memset(pixels, 0, width * height * sizeof(uint32_t));
+    memset(pixels, 0, (size_t)width * height * sizeof(uint32_t));
 
     result->pixels = pixels;
     result->width = width;
@@ -39,14 +48,14 @@ int pictoro_create_frame(p_frame **frame, const int width, const int height)
 } 
 
 
-void pictoro_free_frame(p_frame *frame)
+static inline void pictoro_free_frame(p_frame *frame)
 {
     free(frame->pixels);
     free(frame);
 }
 
 
-void pictoro_copy_frame(p_frame *dest, p_frame *src)
+static inline void pictoro_copy_frame(p_frame *dest, p_frame *src)
 {
     if (src->width == dest->width && src->height == dest->height)
     {
@@ -59,7 +68,7 @@ void pictoro_copy_frame(p_frame *dest, p_frame *src)
 }
 
 
-void pictoro_set_pixel(p_frame *frame, const int x, const int y, const uint32_t color)
+static inline void pictoro_set_pixel(p_frame *frame, const int x, const int y, const uint32_t color)
 {
     if (x >= 0 && x < frame->width && y >= 0 && y < frame->height)
     {
@@ -69,7 +78,7 @@ void pictoro_set_pixel(p_frame *frame, const int x, const int y, const uint32_t
 }
 
 
-uint32_t pictoro_get_pixel(const p_frame *frame, const int x, const int y)
+static inline uint32_t pictoro_get_pixel(const p_frame *frame, const int x, const int y)
 {
     uint32_t color;
     if (x >= 0 && x < frame->width && y >= 0 && y < frame->height)
@@ -80,61 +89,68 @@ uint32_t pictoro_get_pixel(const p_frame *frame, const int x, const int y)
 }
 
 
-void pictoro_fill_frame(p_frame *frame, const uint32_t color)
+// Fill count pixels from dest with color, eight or four at a time where
+// the target has the vector registers for it
+static inline void pictoro_fill_span(uint32_t *dest, const size_t count, const uint32_t color)
 {
-    for (int i = 0; i < frame->width * frame->height; ++i)
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i value = _mm256_set1_epi32((int)color);
+    for (; i + 16 <= count; i += 16)
+    {
+        _mm256_storeu_si256((__m256i *)(dest + i), value);
+        _mm256_storeu_si256((__m256i *)(dest + i + 8), value);
+    }
+#elif defined(__SSE2__)
+    const __m128i value = _mm_set1_epi32((int)color);
+    for (; i + 8 <= count; i += 8)
     {
-        frame->pixels[i] = color;
+        _mm_storeu_si128((__m128i *)(dest + i), value);
+        _mm_storeu_si128((__m128i *)(dest + i + 4), value);
     }
+#endif
+    for (; i < count; ++i)
+        dest[i] = color;
 }
 
 
-void pictoro_fill_hline(p_frame *frame, const int y, const uint32_t color)
+static inline void pictoro_fill_frame(p_frame *frame, const uint32_t color)
 {
-    if (y >= 0 && y < frame->height)
-    {
-        for (int i = 0; i < frame->width; ++i)
-        {
-            pictoro_set_pixel(frame, i, y, color);
-        }
-    }
+    pictoro_fill_span(frame->pixels, (size_t)frame->width * frame->height, color);
+    frame->changed = true;
 }
 
 
-void pictoro_fill_vline(p_frame *frame, const int x, const uint32_t color)
+// Clipped to the frame once up front, so each row is a single span. The
+// far edges are worked out in 64 bits, where x + w can't overflow.
+static inline void pictoro_fill_rect(p_frame *frame, int x, int y, int w, int h, uint32_t color)
 {
-    if (x >= 0 && x < frame->width)
-    {
-        for (int i = 0; i < frame->height; ++i)
-        {
-            pictoro_set_pixel(frame, x, i, color);
-        }
-    }
+    int64_t left = x > 0 ? x : 0;
+    int64_t top = y > 0 ? y : 0;
+    int64_t right = (int64_t)x + w < frame->width ? (int64_t)x + w : frame->width;
+    int64_t bottom = (int64_t)y + h < frame->height ? (int64_t)y + h : frame->height;
+    if (left >= right || top >= bottom)
+        return;
+
+    for (int64_t i = top; i < bottom; ++i)
+        pictoro_fill_span(frame->pixels + i * frame->width + left, right - left, color);
+    frame->changed = true;
 }
 
 
-void pictoro_fill_rect(p_frame *frame, int x, int y, int w, int h, uint32_t color)
+static inline void pictoro_fill_hline(p_frame *frame, const int y, const uint32_t color)
 {
-    if (x < frame->width || y < frame->height)
-    {
-        for (int i = y; i < y + h; ++i)
-        {
-            if (i >= frame->height)
-                break;
-            
-            for (int j = x; j < x + w; ++j)
-            {
-                if (j >= frame->width)
-                    break;
-                
-                pictoro_set_pixel(frame, j, i, color);
-            }
-        }
-    }
+    pictoro_fill_rect(frame, 0, y, frame->width, 1, color);
+}
+
+
+static inline void pictoro_fill_vline(p_frame *frame, const int x, const uint32_t color)
+{
+    pictoro_fill_rect(frame, x, 0, 1, frame->height, color);
 }
 
 
-void pictoro_copy_rect(p_frame *dest, p_frame *src, const int x, const int y, const int h, const int w)
+static inline void pictoro_copy_rect(p_frame *dest, p_frame *src, const int x, const int y, const int h, const int w)
 {
     if (x < dest->width || y < dest->height)
     {
@@ -155,22 +171,23 @@ void pictoro_copy_rect(p_frame *dest, p_frame *src, const int x, const int y, co
 }
 
 
-void pictoro_fill_circle(p_frame *frame, const int x, const int y, const int radius, const uint32_t color)
+// A span per row, out to the widest j with i * i + j * j <= radius * radius,
+// which only narrows moving away from the centre row
+static inline void pictoro_fill_circle(p_frame *frame, const int x, const int y, const int radius, const uint32_t color)
 {
-    for (int i = -radius; i <= radius; ++i)
+    int half = radius;
+    for (int i = 0; i <= radius; ++i)
     {
-        for (int j = -radius; j <= radius; ++j)
-        {
-            if (i * i + j * j <= radius * radius)
-                pictoro_set_pixel(frame, x + j, y + i, color);
-
-        }
+        while (half * half > radius * radius - i * i)
+            --half;
+        pictoro_fill_rect(frame, x - half, y + i, 2 * half + 1, 1, color);
+        if (i > 0)
+            pictoro_fill_rect(frame, x - half, y - i, 2 * half + 1, 1, color);
     }
-
 }
 
 
-void pictoro_write_str(p_frame *frame, const int x, const int y, 
+static inline void pictoro_write_str(p_frame *frame, const int x, const int y, 
                           const char *str, const uint32_t color, const uint8_t font_size)
 {
     const int column_spacing = font_size * 10;
@@ -222,9 +239,9 @@ void pictoro_write_str(p_frame *frame, const int x, const int y,
 }
 
 
-int pictoro_save_frame(const p_frame *frame, const char *filename)
+static inline int pictoro_save_frame(const p_frame *frame, const char *filename)
 {
-    FILE *f = fopen(filename, "w");
+    FILE *f = fopen(filename, "wb");
     if (f == NULL)
         return 1;
 
@@ -232,9 +249,9 @@ int pictoro_save_frame(const p_frame *frame, const char *filename)
     char *ppm_header_fmt = "P6\n%u %u\n255\n";
     snprintf(header, sizeof(header), ppm_header_fmt, frame->width, frame->height);
     header[PPM_HEADER_MAXSIZE - 1] = 0;
-    fwrite(header, sizeof(char), strlen(header), f);
+    bool failed = fwrite(header, sizeof(char), strlen(header), f) != strlen(header);
 
-    for (int i = 0; i < frame->width * frame->height; ++i)
+    for (int i = 0; i < frame->width * frame->height && !failed; ++i)
     {
         uint32_t pixel = frame->pixels[i];
 
@@ -243,8 +260,85 @@ int pictoro_save_frame(const p_frame *frame, const char *filename)
         value[1] = (pixel >> 16) & 0xFF;
         value[2] = (pixel >> 8 ) & 0xFF;
 
-        fwrite(value, sizeof(value), 1, f);
+        failed = fwrite(value, sizeof(value), 1, f) != 1;
     }
+
+    if (fclose(f) != 0)
+        failed = true;
+    return failed;
+}
+
+
+// Next number in a PPM header, skipping whitespace and # comments
+static inline int pictoro_read_ppm_value(FILE *f, unsigned int *value)
+{
+    int c = fgetc(f);
+    while (c == '#' || c == ' ' || c == '\t' || c == '\n' || c == '\r')
+    {
+        if (c == '#')
+            while (c != '\n' && c != EOF)
+                c = fgetc(f);
+        c = fgetc(f);
+    }
+
+    if (c < '0' || c > '9')
+        return 1;
+    *value = 0;
+    while (c >= '0' && c <= '9')
+    {
+        *value = *value * 10 + (c - '0');
+        if (*value > PPM_MAX_DIMENSION)
+            return 1;
+        c = fgetc(f);
+    }
+    // The single whitespace character ending the header is consumed here
+    return c == EOF;
+}
+
+
+// Read a binary PPM (P6, as pictoro_save_frame writes) into a new frame
+static inline int pictoro_load_frame(p_frame **frame, const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL)
+        return 1;
+
+    unsigned int width, height, max_value;
+    if (fgetc(f) != 'P' || fgetc(f) != '6' ||
+        pictoro_read_ppm_value(f, &width) || pictoro_read_ppm_value(f, &height) ||
+        pictoro_read_ppm_value(f, &max_value) ||
+        width == 0 || height == 0 || max_value == 0 || max_value > 255)
+    {
+        fclose(f);
+        return 1;
+    }
+
+    // Sized in size_t, and refused rather than wrapped if it can't be
+    const size_t n_pixels = (size_t)width * height;
+    if (n_pixels / width != height || n_pixels > SIZE_MAX / sizeof(uint32_t) ||
+        pictoro_create_frame(frame, width, height))
+    {
+        fclose(f);
+        return 1;
+    }
+
+    for (size_t i = 0; i < n_pixels; ++i)
+    {
+        uint8_t value[3];
+        if (fread(value, sizeof(value), 1, f) != 1)
+        {
+            pictoro_free_frame(*frame);
+            fclose(f);
+            return 1;
+        }
+
+        uint32_t pixel = 0xFF;
+        for (int c = 0; c < 3; ++c)
+            pixel |= (uint32_t)(value[c] < max_value ? value[c] * 255 / max_value : 255) << (24 - 8 * c);
+        (*frame)->pixels[i] = pixel;
+    }
+
+    fclose(f);
     return 0;
 }
 
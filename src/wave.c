@@ -1,27 +1,66 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bitset.h"
+#include "logging.h"
 #include "wave.h"
 
 #ifndef _UNIT_TEST
 #define internal static
 
+// A sample re-encoded as palette indices, each fitting in index_bits bits
+typedef struct IndexedGrid
+{
+    uint8_t *cells;
+    unsigned int rows, cols;
+    unsigned int index_bits;
+} IndexedGrid;
+
 typedef struct Pattern
 {
-    uint32_t *values;
+    uint8_t *values;
+    uint64_t key;                   // packed values, when they fit in a word
     unsigned int count;
 } Pattern;
 
+// A pattern whose palette indices fit in 64 bits is packed row-major into
+// one word, cell (x, y) at bit (y * N + x) * index_bits. Equality and
+// hashing are then a single compare, and the strips patterns overlap on
+// are a shift and a mask.
+typedef struct KeyLayout KeyLayout;
 
-typedef struct PatternList
+typedef struct KeyKernels
 {
-    size_t *patterns;
-    unsigned int count, capacity;
-} PatternList;
+    uint64_t (*pack)(const KeyLayout *layout, const uint8_t *values);
+    void (*unpack)(const KeyLayout *layout, uint64_t key, uint8_t *values);
+    uint64_t (*rotate)(const KeyLayout *layout, const uint64_t key);
+    uint64_t (*reflect)(const KeyLayout *layout, const uint64_t key);
+} KeyKernels;
+
+struct KeyLayout
+{
+    unsigned int pattern_size, index_bits;
+    uint64_t top_mask;              // the top N-1 rows
+    uint64_t left_mask;             // the left N-1 columns
+    const KeyKernels *kernels;      // chosen for pattern_size by key_layout_init
+};
 
 
 #else 
@@ -29,11 +68,25 @@ typedef struct PatternList
 #endif  // ifndef _UNIT_TEST
 
 #define N_DIRECTIONS 4   // UP LEFT RIGHT DOWN
-#define N_SYMMETRIES 4   // 4 Rotations
+#define MAX_SYMMETRIES 8 // 4 rotations, each also reflected
+
+// w·log(w) of each pattern weight is stored in fixed point with this scale,
+// so per-cell entropy sums are exact integers whatever order bans arrive in
+#define ENTROPY_FIXED_POINT_SCALE 16777216.0
+#define ENTROPY_NOISE 1e-6
+
+#define WFC_DEFAULT_MAX_ATTEMPTS 10
+#define WFC_DEFAULT_SYMMETRY 4
 
+// Parallel propagation: cells revisited serially before a cascade is big
+// enough to hand over to the band threads, and the most bands a wave is
+// split into
+#define PARALLEL_PROPAGATION_THRESHOLD 4096
+#define MAX_PROPAGATION_THREADS 64
 
-internal uint32_t 
-cellgrid_get_cell(const CellGrid *grid, const unsigned int x, const unsigned int y)
+
+internal uint8_t 
+indexedgrid_get_cell(const IndexedGrid *grid, const unsigned int x, const unsigned int y)
 {
     if (x < grid->cols && y < grid->rows) {
         return grid->cells[y * grid->cols + x];
@@ -56,16 +109,6 @@ pattern_print(Pattern *pattern, int pattern_size)
 }
 
 
-internal bool
-pattern_equals(Pattern first, Pattern second, int pattern_size)
-{
-    for (int i = 0; i < pattern_size * pattern_size; ++i)
-        if (first.values[i] != second.values[i])
-            return false;
-    return true;
-}
-
-
 // internal Pattern *
 // pattern_create(int pattern_size)
 // {
@@ -76,438 +119,4014 @@ pattern_equals(Pattern first, Pattern second, int pattern_size)
 // }
 
 
-internal void 
-pattern_copy(Pattern *const dest, const Pattern *const src, const int pattern_size)
+// Open-addressing hash set of fixed-length byte runs stored back to back
+// in an arena, keyed on their contents, with linear probing. Slots hold
+// arena index + 1 so that zero marks an empty slot. The key_table_*
+// functions use the same table for runs already packed into one word.
+typedef struct ValueTable
+{
+    size_t *slots;
+    size_t capacity;                // power of two, kept at least twice the entry count
+} ValueTable;
+
+
+internal uint64_t
+key_hash(uint64_t key)
 {
-    memcpy(dest->values, src->values, pattern_size * pattern_size * sizeof(uint32_t));
-    dest->count = src->count;
+    key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9;
+    key = (key ^ (key >> 27)) * 0x94D049BB133111EB;
+    return key ^ (key >> 31);
 }
 
 
-internal PatternList *
-patternlist_create(const int capacity)
+internal uint64_t
+value_hash(const void *values, const size_t n_bytes)
 {
-    PatternList *result = malloc(sizeof(PatternList));
-    size_t *patterns = calloc(capacity, sizeof(size_t));
+    const unsigned char *bytes = values;
+    uint64_t hash = 0x9E3779B97F4A7C15;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= n_bytes; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = key_hash(hash ^ word);
+    }
+    if (i < n_bytes) {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, n_bytes - i);
+        hash = key_hash(hash ^ word);
+    }
+    return hash;
+}
 
-    result->count = 0;
-    result->capacity = capacity;
-    result->patterns = patterns;
 
-    return result;
+// Return the slot holding a run equal to values, or the empty slot where
+// it belongs
+internal size_t
+value_table_find(const ValueTable *table, const void *arena,
+                 const void *values, const size_t n_bytes)
+{
+    size_t mask = table->capacity - 1;
+    size_t slot = value_hash(values, n_bytes) & mask;
+
+    while (table->slots[slot]) {
+        const char *existing = (const char *)arena + (table->slots[slot] - 1) * n_bytes;
+        if (memcmp(existing, values, n_bytes) == 0)
+            break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
 }
 
-internal void 
-patternlist_append(PatternList *const list, const int value)
+
+internal bool
+value_table_grow(ValueTable *table, const void *arena, const size_t count, const size_t n_bytes)
 {
-    if (list->count > (list->capacity / 2)) {
-        list->capacity *= 2;
-        list->patterns = realloc(list->patterns, list->capacity * sizeof(int));
-        list->patterns = realloc(list->patterns, list->capacity * sizeof(int));
-        
-        list->patterns = realloc(list->patterns, list->capacity * sizeof(int));  
-        
+    ValueTable grown = {.capacity = table->capacity * 2};
+    grown.slots = calloc(grown.capacity, sizeof(size_t));
+    if (grown.slots == NULL)
+        return false;
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t slot = value_table_find(&grown, arena, (const char *)arena + i * n_bytes, n_bytes);
+        grown.slots[slot] = i + 1;
     }
-    list->patterns[list->count++] = value;
+    free(table->slots);
+    *table = grown;
+    return true;
 }
 
 
-internal void 
-patternlist_free(PatternList *p)
+internal size_t
+key_table_find(const ValueTable *table, const uint64_t *keys, const uint64_t key)
 {
-    free(p->patterns);
-    free(p);
+    size_t mask = table->capacity - 1;
+    size_t slot = key_hash(key) & mask;
+
+    while (table->slots[slot] && keys[table->slots[slot] - 1] != key)
+        slot = (slot + 1) & mask;
+    return slot;
 }
 
 
-internal bool 
-pattern_in_list(Pattern *const new, Pattern *const patterns,
-                const size_t pattern_count, const size_t pattern_size)
+internal bool
+key_table_grow(ValueTable *table, const uint64_t *keys, const size_t count)
 {
-    bool existing_cell = false;
+    ValueTable grown = {.capacity = table->capacity * 2};
+    grown.slots = calloc(grown.capacity, sizeof(size_t));
+    if (grown.slots == NULL)
+        return false;
 
-    for (size_t k = 0; k < pattern_count; ++k)
-    {
+    for (size_t i = 0; i < count; ++i)
+        grown.slots[key_table_find(&grown, keys, keys[i])] = i + 1;
+    free(table->slots);
+    *table = grown;
+    return true;
+}
 
-        if (pattern_equals(*new, patterns[k], pattern_size))
-        {
-            patterns[k].count++;
-            existing_cell = true;
-            break;
+
+// Pack, unpack, rotate and reflect for one pattern size. Sizes 2 and 3, the
+// common ones, get kernels with the size fixed at compile time so their
+// loops unroll; every other size uses the generic ones.
+static inline uint64_t
+key_pack(const uint8_t *values, const unsigned int n, const unsigned int bits)
+{
+    uint64_t key = 0;
+#pragma GCC unroll 16
+    for (unsigned int i = 0; i < n * n; ++i)
+        key |= (uint64_t)values[i] << (i * bits);
+    return key;
+}
+
+static inline void
+key_unpack(uint64_t key, const unsigned int n, const unsigned int bits, uint8_t *values)
+{
+    const uint64_t field = ((uint64_t)1 << bits) - 1;
+#pragma GCC unroll 16
+    for (unsigned int i = 0; i < n * n; ++i, key >>= bits)
+        values[i] = key & field;
+}
+
+// The same rotation and reflection as pattern_rotate and pattern_reflect,
+// field by field
+static inline uint64_t
+key_rotate(const uint64_t key, const unsigned int n, const unsigned int bits)
+{
+    const uint64_t field = ((uint64_t)1 << bits) - 1;
+    uint64_t rotated = 0;
+#pragma GCC unroll 4
+    for (unsigned int y = 0; y < n; ++y) {
+#pragma GCC unroll 4
+        for (unsigned int x = 0; x < n; ++x) {
+            uint64_t value = (key >> ((y * n + x) * bits)) & field;
+            rotated |= value << (((n - 1 - x) * n + y) * bits);
         }
     }
-    return existing_cell;
+    return rotated;
 }
 
+static inline uint64_t
+key_reflect(const uint64_t key, const unsigned int n, const unsigned int bits)
+{
+    const uint64_t field = ((uint64_t)1 << bits) - 1;
+    uint64_t reflected = 0;
+#pragma GCC unroll 4
+    for (unsigned int y = 0; y < n; ++y) {
+#pragma GCC unroll 4
+        for (unsigned int x = 0; x < n; ++x) {
+            uint64_t value = (key >> ((y * n + x) * bits)) & field;
+            reflected |= value << ((y * n + n - 1 - x) * bits);
+        }
+    }
+    return reflected;
+}
 
-internal int 
-generate_patterns(const CellGrid *const grid, const unsigned int max_patterns, 
-                  const unsigned int pattern_size, Pattern **results)
+
+#define KEY_KERNELS(name, n)                                                    \
+    internal uint64_t                                                           \
+    pattern_key_pack_##name(const KeyLayout *layout, const uint8_t *values)     \
+    {                                                                           \
+        return key_pack(values, (n), layout->index_bits);                       \
+    }                                                                           \
+                                                                                \
+    internal void                                                               \
+    pattern_key_unpack_##name(const KeyLayout *layout, uint64_t key,            \
+                              uint8_t *values)                                  \
+    {                                                                           \
+        key_unpack(key, (n), layout->index_bits, values);                       \
+    }                                                                           \
+                                                                                \
+    internal uint64_t                                                           \
+    pattern_key_rotate_##name(const KeyLayout *layout, const uint64_t key)      \
+    {                                                                           \
+        return key_rotate(key, (n), layout->index_bits);                        \
+    }                                                                           \
+                                                                                \
+    internal uint64_t                                                           \
+    pattern_key_reflect_##name(const KeyLayout *layout, const uint64_t key)     \
+    {                                                                           \
+        return key_reflect(key, (n), layout->index_bits);                       \
+    }                                                                           \
+                                                                                \
+    internal const KeyKernels key_kernels_##name = {                            \
+        pattern_key_pack_##name, pattern_key_unpack_##name,                     \
+        pattern_key_rotate_##name, pattern_key_reflect_##name,                  \
+    };
+
+KEY_KERNELS(generic, layout->pattern_size)
+KEY_KERNELS(2, 2)
+KEY_KERNELS(3, 3)
+
+#undef KEY_KERNELS
+
+
+internal bool
+key_layout_init(KeyLayout *layout, const unsigned int pattern_size, const unsigned int index_bits)
+{
+    const unsigned int n = pattern_size;
+    if (n * n * index_bits > 64)
+        return false;
+
+    uint64_t field = ((uint64_t)1 << index_bits) - 1;
+    layout->pattern_size = n;
+    layout->index_bits = index_bits;
+    layout->top_mask = 0;
+    layout->left_mask = 0;
+    for (unsigned int y = 0; y < n; ++y) {
+        for (unsigned int x = 0; x < n; ++x) {
+            uint64_t cell = field << ((y * n + x) * index_bits);
+            if (y < n - 1)
+                layout->top_mask |= cell;
+            if (x < n - 1)
+                layout->left_mask |= cell;
+        }
+    }
+
+    switch (n) {
+    case 2: layout->kernels = &key_kernels_2; break;
+    case 3: layout->kernels = &key_kernels_3; break;
+    default: layout->kernels = &key_kernels_generic; break;
+    }
+    return true;
+}
+
+
+// The strip a pattern shows its neighbour in direction d, shifted down so
+// that strips facing opposite directions compare equal when they match
+internal uint64_t
+pattern_key_strip(const KeyLayout *layout, const uint64_t key, const int d)
 {
+    switch (d) {
+    case 0: return key & layout->top_mask;
+    case 1: return key & layout->left_mask;
+    case 2: return (key >> layout->index_bits) & layout->left_mask;
+    default: return key >> (layout->pattern_size * layout->index_bits);
+    }
+}
 
-    Pattern *patterns = malloc(sizeof(Pattern) * max_patterns);
 
-    for (size_t i = 0; i < max_patterns; ++i) {
-        patterns[i].values = malloc(pattern_size * pattern_size * sizeof(int));
+// Rotate a pattern's values a quarter turn
+internal void
+pattern_rotate(uint8_t *values, const unsigned int pattern_size)
+{
+    uint8_t rotated_values[pattern_size * pattern_size];
+    for (size_t y = 0; y < pattern_size; ++y) {
+        for (size_t x1 = 0, x2 = pattern_size - 1; x1 < pattern_size; ++x1, --x2) {
+            rotated_values[x2 * pattern_size + y] = values[y * pattern_size + x1];
+        }
     }
+    memcpy(values, rotated_values, sizeof(rotated_values));
+}
 
-    int pattern_count = 0;
-    for (size_t i = 0; i < grid->rows - (pattern_size - 1); ++i) {
-        for (size_t j = 0; j < grid->cols - (pattern_size - 1); ++j) {
-            int idx = 0;
-            Pattern new = {.count = 1};
-            uint32_t new_values[pattern_size * pattern_size];
-            new.values = new_values;
 
+// Mirror a pattern's values left to right
+internal void
+pattern_reflect(uint8_t *values, const unsigned int pattern_size)
+{
+    for (size_t y = 0; y < pattern_size; ++y) {
+        uint8_t *row = values + y * pattern_size;
+        for (size_t x1 = 0, x2 = pattern_size - 1; x1 < x2; ++x1, --x2) {
+            uint8_t value = row[x1];
+            row[x1] = row[x2];
+            row[x2] = value;
+        }
+    }
+}
+
+
+// Extract every pattern_size x pattern_size window of the grid, wrapping
+// around its edges if periodic, and count how often each distinct pattern
+// occurs among the windows and their symmetric variants: the window itself
+// (symmetry 1), plus its mirror image (2), or its four rotations (4), or
+// the rotations and their mirror images (8).
+//
+// The variants of a window form an orbit that every variant shares, so a
+// window already seen as any pattern just adds one to each member of its
+// orbit instead of recomputing them. Pattern values are stored back to back
+// in one arena, patterns[0].values, which the caller frees along with the
+// array. Patterns small enough to pack into a word are deduplicated on their
+// keys. Returns the number of patterns, or -1 if memory ran out.
+internal int 
+generate_patterns(const IndexedGrid *const grid, const unsigned int pattern_size, const unsigned int symmetry,
+                  const bool periodic, Pattern **results)
+{
+    const size_t n_values = pattern_size * pattern_size;
+    const unsigned int n_rotations = symmetry >= 4 ? 4 : 1;
+    KeyLayout layout;
+    const bool packed = key_layout_init(&layout, pattern_size, grid->index_bits);
+    size_t capacity = 64;
+    size_t pattern_count = 0;
+    uint8_t *arena = malloc(capacity * n_values);
+    uint64_t *keys = malloc(capacity * sizeof(uint64_t));
+    unsigned int *counts = malloc(capacity * sizeof(unsigned int));
+    // Orbit o lists its symmetry variants at orbits[o * symmetry], which
+    // repeats a pattern that is its own variant
+    uint32_t *pattern_orbits = malloc(capacity * sizeof(uint32_t));
+    uint32_t *orbits = malloc(capacity * symmetry * sizeof(uint32_t));
+    size_t n_orbits = 0;
+    ValueTable table = {.capacity = 2 * capacity};
+    table.slots = calloc(table.capacity, sizeof(size_t));
+
+    if (!arena || !keys || !counts || !pattern_orbits || !orbits || !table.slots)
+        goto fail;
+
+    const size_t n_window_rows = periodic ? grid->rows : grid->rows - (pattern_size - 1);
+    const size_t n_window_cols = periodic ? grid->cols : grid->cols - (pattern_size - 1);
+
+    for (size_t i = 0; i < n_window_rows; ++i) {
+        for (size_t j = 0; j < n_window_cols; ++j) {
+            int idx = 0;
+            uint8_t new_values[n_values];
 
             for (size_t k = 0; k < pattern_size; ++k) {
                 for (size_t l = 0; l < pattern_size; ++l) {
-                    new.values[idx++] = cellgrid_get_cell(grid, j + l, i + k);
+                    new_values[idx++] = indexedgrid_get_cell(grid, (j + l) % grid->cols, (i + k) % grid->rows);
                 }
             }
+            uint64_t key = packed ? layout.kernels->pack(&layout, new_values) : 0;
 
-            
-            
-            // Check if already in list
-            if (!pattern_in_list(&new, patterns, pattern_count, pattern_size)) {
-                pattern_copy(&patterns[pattern_count++], &new, pattern_size);
-            } else {
+            size_t slot = packed ? key_table_find(&table, keys, key)
+                                 : value_table_find(&table, arena, new_values, n_values);
+            if (table.slots[slot]) {
+                const uint32_t *orbit = orbits + pattern_orbits[table.slots[slot] - 1] * symmetry;
+                for (size_t k = 0; k < symmetry; ++k)
+                    counts[orbit[k]]++;
                 continue;
             }
-            // Add all symmetries to list
-            for (size_t k = 0; k < N_SYMMETRIES - 1; ++k) {
-                uint32_t rotated_values[pattern_size * pattern_size];
-                for (size_t y = 0; y < pattern_size; ++y) {
-                    for (size_t x1 = 0, x2 = pattern_size - 1; x1 < pattern_size; ++x1, --x2) {
-                        rotated_values[x2 * pattern_size + y] = new.values[y * pattern_size + x1];
-                    }
+
+            // A new orbit. Its variants are either new patterns or repeats
+            // of earlier variants of the same orbit, and it always adds at
+            // least the window itself, so there are never more orbits than
+            // patterns.
+            uint64_t base_key = key;
+            uint8_t base_values[n_values];
+            memcpy(base_values, new_values, sizeof(base_values));
+
+            for (size_t k = 0; k < symmetry; ++k) {
+                size_t rotation = k % n_rotations;
+                if (k == 0) {
+                    // the window itself
+                } else if (rotation == 0 && packed) {
+                    key = layout.kernels->reflect(&layout, base_key);
+                } else if (rotation == 0) {
+                    memcpy(new_values, base_values, sizeof(base_values));
+                    pattern_reflect(new_values, pattern_size);
+                } else if (packed) {
+                    key = layout.kernels->rotate(&layout, key);
+                } else {
+                    pattern_rotate(new_values, pattern_size);
+                }
+
+                slot = packed ? key_table_find(&table, keys, key)
+                              : value_table_find(&table, arena, new_values, n_values);
+                if (table.slots[slot]) {
+                    orbits[n_orbits * symmetry + k] = table.slots[slot] - 1;
+                    counts[table.slots[slot] - 1]++;
+                    continue;
                 }
-                memcpy(new.values, rotated_values, sizeof(rotated_values));
-                if (!pattern_in_list(&new, patterns, pattern_count, pattern_size)) {
-                    pattern_copy(&patterns[pattern_count++], &new, pattern_size);
+
+                if (pattern_count == capacity) {
+                    capacity *= 2;
+                    uint8_t *grown_arena = realloc(arena, capacity * n_values);
+                    uint64_t *grown_keys = realloc(keys, capacity * sizeof(uint64_t));
+                    unsigned int *grown_counts = realloc(counts, capacity * sizeof(unsigned int));
+                    uint32_t *grown_pattern_orbits = realloc(pattern_orbits, capacity * sizeof(uint32_t));
+                    uint32_t *grown_orbits = realloc(orbits, capacity * symmetry * sizeof(uint32_t));
+                    if (grown_arena)
+                        arena = grown_arena;
+                    if (grown_keys)
+                        keys = grown_keys;
+                    if (grown_counts)
+                        counts = grown_counts;
+                    if (grown_pattern_orbits)
+                        pattern_orbits = grown_pattern_orbits;
+                    if (grown_orbits)
+                        orbits = grown_orbits;
+                    if (!grown_arena || !grown_keys || !grown_counts || !grown_pattern_orbits || !grown_orbits)
+                        goto fail;
                 }
+                if (packed)
+                    layout.kernels->unpack(&layout, key, arena + pattern_count * n_values);
+                else
+                    memcpy(arena + pattern_count * n_values, new_values, sizeof(new_values));
+                keys[pattern_count] = key;
+                counts[pattern_count] = 1;
+                pattern_orbits[pattern_count] = n_orbits;
+                orbits[n_orbits * symmetry + k] = pattern_count;
+                table.slots[slot] = ++pattern_count;
+
+                if (2 * pattern_count > table.capacity &&
+                    !(packed ? key_table_grow(&table, keys, pattern_count)
+                             : value_table_grow(&table, arena, pattern_count, n_values)))
+                    goto fail;
             }
+            n_orbits++;
         }
     }
 
+    Pattern *patterns = malloc(pattern_count * sizeof(Pattern));
+    if (patterns == NULL)
+        goto fail;
+
+    for (size_t i = 0; i < pattern_count; ++i) {
+        patterns[i].values = arena + i * n_values;
+        patterns[i].key = keys[i];
+        patterns[i].count = counts[i];
+    }
+
+    free(keys);
+    free(counts);
+    free(pattern_orbits);
+    free(orbits);
+    free(table.slots);
     *results = patterns;
     return pattern_count;
+
+fail:
+    free(arena);
+    free(keys);
+    free(counts);
+    free(pattern_orbits);
+    free(orbits);
+    free(table.slots);
+    return -1;
 }
 
-internal bool 
-check_vertical_match(uint32_t *top, uint32_t *bottom, int pattern_size)
+
+// Adjacency rules in compressed sparse row form: the patterns allowed in
+// direction d of pattern p are
+// patterns[offsets[p * N_DIRECTIONS + d] .. offsets[p * N_DIRECTIONS + d + 1]),
+// in ascending order
+typedef struct Rules
 {
-    for (int i = 0; i < (pattern_size * (pattern_size-1)); ++i) {
-        if (bottom[i] != top[i + pattern_size])
-            return false;
+    uint32_t *offsets;              // n_patterns * N_DIRECTIONS + 1
+    uint32_t *patterns;
+} Rules;
+
+
+internal uint32_t
+rules_count(const Rules *rules, const size_t rule)
+{
+    return rules->offsets[rule + 1] - rules->offsets[rule];
+}
+
+
+internal void
+rules_free(Rules *rules)
+{
+    free(rules->offsets);
+    free(rules->patterns);
+}
+
+
+// Copy the N x (N-1) strip of a pattern that overlaps its neighbour in
+// direction d: the top rows for up, the left columns for left, and so on
+internal void
+pattern_strip(const uint8_t *values, const unsigned int pattern_size, const int d, uint8_t *strip)
+{
+    const size_t n = pattern_size;
+    switch (d) {
+    case 0: memcpy(strip, values, n * (n - 1)); break;
+    case 3: memcpy(strip, values + n, n * (n - 1)); break;
+    case 1:
+    case 2:
+        for (size_t y = 0; y < n; ++y)
+            memcpy(strip + y * (n - 1), values + y * n + (d == 2), n - 1);
+        break;
     }
-    return true;
 }
 
+
+// Pattern q may sit in direction d of pattern p when the strip of p facing
+// d equals the strip of q facing back the other way. Rather than comparing
+// every pair, give each distinct strip an id, bucket patterns by the id of
+// the strip they show in each direction, and read the rules off the buckets.
+// Returns false if memory ran out.
 internal bool
-check_horizontal_match(uint32_t *left, uint32_t *right, int pattern_size)
+establish_rules(const size_t n_patterns, const Pattern *patterns, const unsigned int pattern_size,
+                const unsigned int index_bits, Rules *rules)
 {
-    for (int i = 0; i < pattern_size * pattern_size; ++i) {
-        if ((i % pattern_size) == (pattern_size - 1)){
-            continue;
-        }
-        if (right[i] != left[i + 1]) {
-            return false;
+    const size_t n_rules = n_patterns * N_DIRECTIONS;
+    const size_t n_values = pattern_size * (pattern_size - 1);
+    KeyLayout layout;
+    const bool packed = key_layout_init(&layout, pattern_size, index_bits);
+    size_t capacity = 1;
+    while (capacity < 2 * n_rules)
+        capacity *= 2;
+
+    bool ok = false;
+    // Strip contents: packed keys, or byte runs when patterns don't pack
+    void *strips = packed ? malloc(n_rules * sizeof(uint64_t)) : malloc(n_rules * n_values + 1);
+    uint32_t *strip_ids = malloc(n_rules * sizeof(uint32_t));
+    uint32_t *bucket_offsets = calloc(N_DIRECTIONS * (n_rules + 1), sizeof(uint32_t));
+    uint32_t *buckets = malloc(n_rules * sizeof(uint32_t));
+    ValueTable table = {.capacity = capacity};
+    table.slots = calloc(table.capacity, sizeof(size_t));
+    rules->offsets = malloc((n_rules + 1) * sizeof(uint32_t));
+    rules->patterns = NULL;
+
+    if (!strips || !strip_ids || !bucket_offsets || !buckets || !table.slots || !rules->offsets)
+        goto cleanup;
+
+    // Strip ids are the index of the first strip with the same contents
+    for (size_t r = 0; r < n_rules; ++r) {
+        size_t slot;
+        if (packed) {
+            uint64_t *strip = (uint64_t *)strips + r;
+            *strip = pattern_key_strip(&layout, patterns[r / N_DIRECTIONS].key, r % N_DIRECTIONS);
+            slot = key_table_find(&table, strips, *strip);
+        } else {
+            uint8_t *strip = (uint8_t *)strips + r * n_values;
+            pattern_strip(patterns[r / N_DIRECTIONS].values, pattern_size, r % N_DIRECTIONS, strip);
+            slot = value_table_find(&table, strips, strip, n_values);
         }
+        if (!table.slots[slot])
+            table.slots[slot] = r + 1;
+        strip_ids[r] = table.slots[slot] - 1;
     }
-    return true;
+
+    // Counting sort of patterns into (direction, strip id) buckets; walking
+    // patterns in order keeps every bucket ascending
+    for (size_t r = 0; r < n_rules; ++r)
+        bucket_offsets[(r % N_DIRECTIONS) * (n_rules + 1) + strip_ids[r] + 1]++;
+    for (int d = 0; d < N_DIRECTIONS; ++d) {
+        uint32_t *offsets = bucket_offsets + d * (n_rules + 1);
+        for (size_t id = 0; id < n_rules; ++id)
+            offsets[id + 1] += offsets[id];
+    }
+    for (size_t r = 0; r < n_rules; ++r) {
+        uint32_t *offsets = bucket_offsets + (r % N_DIRECTIONS) * (n_rules + 1);
+        buckets[(r % N_DIRECTIONS) * n_patterns + offsets[strip_ids[r]]++] = r / N_DIRECTIONS;
+    }
+    // The fill pass moved each bucket start onto the next one's; shift back
+    for (int d = 0; d < N_DIRECTIONS; ++d) {
+        uint32_t *offsets = bucket_offsets + d * (n_rules + 1);
+        memmove(offsets + 1, offsets, n_rules * sizeof(uint32_t));
+        offsets[0] = 0;
+    }
+
+    // Rule (p, d) is the bucket of patterns showing p's strip in direction 3 - d
+    size_t n_allowed = 0;
+    for (size_t r = 0; r < n_rules; ++r) {
+        const uint32_t *offsets = bucket_offsets + (N_DIRECTIONS - 1 - r % N_DIRECTIONS) * (n_rules + 1);
+        rules->offsets[r] = n_allowed;
+        n_allowed += offsets[strip_ids[r] + 1] - offsets[strip_ids[r]];
+    }
+    rules->offsets[n_rules] = n_allowed;
+
+    rules->patterns = malloc((n_allowed + 1) * sizeof(uint32_t));
+    if (rules->patterns == NULL)
+        goto cleanup;
+
+    for (size_t r = 0; r < n_rules; ++r) {
+        int opposite = N_DIRECTIONS - 1 - r % N_DIRECTIONS;
+        const uint32_t *offsets = bucket_offsets + opposite * (n_rules + 1);
+        memcpy(rules->patterns + rules->offsets[r], buckets + opposite * n_patterns + offsets[strip_ids[r]],
+               (rules->offsets[r + 1] - rules->offsets[r]) * sizeof(uint32_t));
+    }
+    ok = true;
+
+cleanup:
+    free(strips);
+    free(strip_ids);
+    free(bucket_offsets);
+    free(buckets);
+    free(table.slots);
+    if (!ok) {
+        rules_free(rules);
+        rules->offsets = rules->patterns = NULL;
+    }
+    return ok;
 }
 
+
+// Flatten each rule list into a bitset of the patterns it allows, so that
+// propagation can combine rules with word-wide OR/AND instead of list walks
 internal void
-establish_rules(int n_patterns, Pattern *patterns, int n_rules, PatternList *rules[n_rules], int pattern_size)
+build_rule_masks(const size_t n_rules, const Rules *rules, const size_t n_words, uint64_t *masks)
 {
-    for (int i = 0; i < n_rules; ++i)
-        rules[i] = patternlist_create(10);
+    memset(masks, 0, n_rules * n_words * sizeof(uint64_t));
+    for (size_t i = 0; i < n_rules; ++i) {
+        uint64_t *mask = masks + i * n_words;
+        for (uint32_t j = rules->offsets[i]; j < rules->offsets[i + 1]; ++j)
+            bitset_set(mask, rules->patterns[j]);
+    }
+}
 
 
-    for (int i = 0; i < n_patterns; ++i)
-    {
-        Pattern pattern = patterns[i];
-        PatternList *current_u_rule = rules[i * N_DIRECTIONS + 0];
-        PatternList *current_l_rule = rules[i * N_DIRECTIONS + 1];
-        PatternList *current_r_rule = rules[i * N_DIRECTIONS + 2];
-        PatternList *current_d_rule = rules[i * N_DIRECTIONS + 3];
+// The inverse of build_rule_masks, for rules declared as pairs of tiles
+// rather than found from pattern overlaps. Returns false if memory ran out.
+internal bool
+rules_from_masks(const size_t n_rules, const uint64_t *masks, const size_t n_words, Rules *rules)
+{
+    size_t n_allowed = bitset_count(masks, n_rules * n_words);
+    rules->offsets = malloc((n_rules + 1) * sizeof(uint32_t));
+    rules->patterns = malloc((n_allowed + 1) * sizeof(uint32_t));
+    if (rules->offsets == NULL || rules->patterns == NULL) {
+        rules_free(rules);
+        rules->offsets = rules->patterns = NULL;
+        return false;
+    }
 
-        for (int j = 0; j < n_patterns; ++j)
-        {
-            Pattern check = patterns[j];
-            // up
-            if (check_vertical_match(check.values, pattern.values, pattern_size))
-                patternlist_append(current_u_rule, j);
+    n_allowed = 0;
+    for (size_t i = 0; i < n_rules; ++i) {
+        const uint64_t *mask = masks + i * n_words;
+        rules->offsets[i] = n_allowed;
+        for (size_t w = 0; w < n_words; ++w)
+            for (uint64_t bits = mask[w]; bits; bits &= bits - 1)
+                rules->patterns[n_allowed++] = w * BITSET_WORD_BITS + __builtin_ctzll(bits);
+    }
+    rules->offsets[n_rules] = n_allowed;
+    return true;
+}
 
-            // left
-            if (check_horizontal_match(check.values, pattern.values, pattern_size))
-                patternlist_append(current_l_rule, j);
-            
-            // right
-            if (check_horizontal_match(pattern.values, check.values, pattern_size))
-                patternlist_append(current_r_rule, j);
 
-            //down
-            if (check_vertical_match(pattern.values, check.values, pattern_size))
-                patternlist_append(current_d_rule, j);
-        }
+internal int64_t
+weight_log_weight(const uint32_t weight)
+{
+    return llround(weight * log(weight) * ENTROPY_FIXED_POINT_SCALE);
+}
+
+
+// Weight each pattern by how many times it was seen in the sample
+internal void
+build_weights(const size_t n_patterns, const Pattern *patterns, uint32_t *weights, int64_t *weight_log_weights)
+{
+    for (size_t i = 0; i < n_patterns; ++i) {
+        weights[i] = patterns[i].count;
+        weight_log_weights[i] = weight_log_weight(weights[i]);
     }
 }
 
 
-internal size_t
-rand_range(const int min_n, const int max_n)
+// splitmix64: small, fast, and any 64-bit state is a valid seed, which
+// makes it easy to hand every attempt its own reproducible stream
+typedef struct Rng
+{
+    uint64_t state;
+} Rng;
+
+
+internal uint64_t
+rng_next(Rng *rng)
 {
-    return (size_t) (rand() % (max_n - min_n + 1) + min_n);
+    uint64_t z = (rng->state += 0x9E3779B97F4A7C15);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+    return z ^ (z >> 31);
 }
 
 
-uint32_t *run_wfc_algo(const CellGrid *grid, const unsigned int pattern_size, const unsigned int output_width, const unsigned int output_height)
+// Stream for one attempt: the same seed and attempt number always give the
+// same sequence, whichever thread runs the attempt
+internal Rng
+rng_stream(const uint64_t seed, const uint64_t attempt)
 {
-    srand(time(NULL));
+    Rng rng = {.state = seed};
+    rng.state = rng_next(&rng) ^ (attempt * 0xD1B54A32D192ED03);
+    return rng;
+}
 
-    Pattern *patterns;
-    size_t max_patterns = (grid->rows - (pattern_size - 1)) * 
-                          (grid->cols - (pattern_size - 1)) * 
-                          N_SYMMETRIES;
 
-    size_t n_patterns = generate_patterns(grid, max_patterns, pattern_size, &patterns);
-    uint32_t *result = malloc(output_width * output_height * sizeof result[0]);
+internal double
+rand_unit(Rng *rng)
+{
+    return (rng_next(rng) >> 11) * 0x1.0p-53;
+}
 
 
-    int n_rules = n_patterns * N_DIRECTIONS;
-    PatternList *rules[n_rules]; 
+// A pattern removed from a cell. Pending AC-4 propagation work and the
+// backtracking undo trail are both lists of these.
+typedef struct Ban
+{
+    uint32_t cell, pattern;
+} Ban;
 
-    establish_rules(n_patterns, patterns, n_rules, rules, pattern_size);
-    
-    size_t output_grid_width = output_width - (pattern_size - 1);
-    size_t output_grid_height = output_height - (pattern_size - 1);
-    size_t output_grid_size =  output_grid_width * output_grid_height;
-    bool output_grid[output_grid_size][n_patterns];
-    size_t counts[output_grid_size];
-    bool changed[output_grid_size];
-    size_t pattern_nos[output_grid_size];
-    for (size_t i = 0; i < output_grid_size; ++i)
-    {
-        for (size_t j = 0; j < n_patterns; ++j)
-        {
-            output_grid[i][j] = true; 
-        }
-        counts[i] = n_patterns;
-        changed[i] = false;
-        pattern_nos[i] = SIZE_MAX;
-    }
 
-    // delete from array by swapping with last element and decrementing count
-    // pick random starting place
-    size_t random_start = rand_range(0, output_grid_size - 1);
-    size_t random_pattern = rand_range(0, n_patterns - 1);
+// An observation that can be taken back: the trail length before it was
+// made, and the pattern the cell was collapsed to
+typedef struct Decision
+{
+    size_t trail_size, cell, pattern;
+} Decision;
 
-    memset(output_grid[random_start], false, n_patterns * sizeof(bool));
-    output_grid[random_start][random_pattern] = true;
-    pattern_nos[random_start] = random_pattern;
-    counts[random_start] = 1;
 
-    //propagate to neighbors
-    size_t current_idx = random_start;
+// Everything the solver needs from the sample, built once and shared
+// read-only by every attempt. Pattern values are 8-bit palette indices,
+// mapped back to colours only when output is rendered. A tiled model has
+// tiles instead: single-cell patterns drawn as tile_size square images, with
+// neither palette nor values. A loaded model points straight into its file
+// mapping; a compiled one owns each array separately.
+struct WfcModel
+{
+    unsigned int pattern_size;
+    size_t n_patterns, n_words, n_colours;
+    const uint32_t *palette;        // n_colours sample colours
+    const uint8_t *values;          // n_patterns * pattern_size^2
+    unsigned int tile_size;         // 0 unless tiled
+    const uint32_t *tiles;          // n_patterns * tile_size^2 pixels
+    Rules rules;
+    const uint64_t *rule_masks;     // n_patterns * N_DIRECTIONS * n_words
+    const uint32_t *weights;
+    const int64_t *weight_log_weights;
 
-    while(1)
-    {
-        // printf("Running for current idx %lu\n", current_idx);
-        changed[current_idx] = false;
-        size_t adj_cells[N_DIRECTIONS];
-        for(size_t i = 0; i < N_DIRECTIONS; ++i)
-            adj_cells[i] = SIZE_MAX;
-
-        if(current_idx >= output_grid_width)                              adj_cells[0] = current_idx - output_grid_width;
-        if(current_idx % output_grid_width)                               adj_cells[1] = current_idx - 1;
-        if((current_idx % output_grid_width) != (output_grid_width - 1))  adj_cells[2] = current_idx + 1;
-        if(current_idx < output_grid_size - output_grid_width)            adj_cells[3] = current_idx + output_grid_width;
-           
-        for(size_t x = 0; x < N_DIRECTIONS; ++x)
-        {
-            size_t new_count = 0;
-            size_t adj_idx = adj_cells[x];
+    void *mapping;                  // NULL unless loaded from a file
+    size_t mapping_size;
+};
 
-            if(adj_idx == SIZE_MAX)
-                continue;
 
-            assert(adj_idx < output_grid_size && "Bad adj idx");
+typedef struct PropagationPool PropagationPool;
 
-            // we need to loop over the current index possible patterns
-            // and for each one: mark the adj_idx cell true if tha pattern is possible
+// The solver's side of WfcStats, kept per wave and summed once the job is done
+typedef struct SolveCounters
+{
+    unsigned int n_attempts;
+    uint64_t n_observations;
+    uint64_t n_propagations;        // cells (bans, for AC-4) passed on to their neighbours
+    uint64_t n_cells_visited;       // neighbours re-checked by those
+    uint64_t n_bans;
+    uint64_t n_contradictions;
+    uint64_t n_parallel_passes;
+    uint64_t propagate_ns, observe_ns;
+} SolveCounters;
 
-            bool possible_adj_patterns[n_patterns];
-            memset(possible_adj_patterns, 0, sizeof(possible_adj_patterns));
+typedef struct Wave
+{
+    size_t width, height, size;     // output grid, in pattern positions
+    size_t n_patterns, n_words;
+    WfcPropagator propagator;
+    const Rules *rules;
+    const uint64_t *rule_masks;
+    const WfcModel *model;          // for drawing previews
+    WfcMonitor *monitor;            // may be NULL
+    Rng rng;
 
-            // We need to OR together each of the rules for the current adj pattern into one array
-            for (size_t i = 0; i < n_patterns; ++i)
-            {
-                if (output_grid[current_idx][i])
-                {
-                    PatternList *up_rule = rules[i * N_DIRECTIONS + x];
-                    for (size_t j = 0; j < up_rule->count; ++j)
-                    {
-                        possible_adj_patterns[up_rule->patterns[j]] = true;
-        
-                    }
-                }
-            }
+    // Parallel attempts: give up once an earlier-numbered attempt succeeds
+    unsigned int attempt;
+    const atomic_uint *best_attempt;
 
-            // Now AND those possibilities with the existing adj pattern possibilities
-            for (size_t i = 0; i < n_patterns; ++i)
-            {
-                if (output_grid[adj_idx][i])
-                {
-                    if (possible_adj_patterns[i])
-                    {
-                        new_count++;
-                    }
-                    else
-                    {
-                        output_grid[adj_idx][i] = false;
-                        changed[adj_idx] = true;
-                    }
-                }
-            }
-            // if (current_idx % output_grid_width == 0 || adj_idx % output_grid_width == 0)
-            // {
-                // printf("\nGrid pos (%ld, %ld) possibilities\n", current_idx % output_grid_width, current_idx / output_grid_width);
-                // for (size_t i = 0; i < n_patterns; ++i)
-                //     printf("Pattern %ld: %s\n", i, output_grid[current_idx][i]? "true" : "false");
-                // printf("\nAdj pos (%ld, %ld) possibilities\n", adj_idx % output_grid_width, adj_idx / output_grid_width);
-                // for (size_t i = 0; i < n_patterns; ++i)
-                //     printf("Pattern %ld: %s\n", i, output_grid[adj_idx][i]? "true" : "false");
-            // }
-            if (!new_count)
-            {
-                // logger(WARNING, "Contradiction reached. Exiting...");
-                printf("Contradiction reached...\n");
-                goto cleanup;
-            }            
-            else if (counts[adj_idx] != 1 && new_count == 1)
-            {
-                for (size_t z = 0; z < n_patterns; ++z)
-                {
-                    if (output_grid[adj_idx][z])
-                    {
-                        pattern_nos[adj_idx] = z;
-                        break;
-                    }
-                }
-            }
-            counts[adj_idx] = new_count;
-        }
+    const size_t *pins;             // pattern each cell is held to, SIZE_MAX if free; may be NULL
+    const uint64_t *allowed;        // size * n_words bitsets of patterns each cell may hold; may be NULL
+    unsigned int open_edges;        // bit d set: more output lies beyond the wave in direction d
+    bool periodic;                  // opposite edges are neighbours
+    uint64_t *cells;                // size * n_words bitsets of possible patterns
+    size_t *counts;                 // live patterns per cell
+    size_t *pattern_nos;            // collapsed pattern, SIZE_MAX until then
+    // Cells whose possibilities shrank and whose neighbours still have to be
+    // revisited. changed[] marks the cells currently on the stack so each one
+    // is queued at most once, which bounds the stack at size.
+    bool *changed;
+    size_t *stack;
+    size_t stack_size;
+    uint64_t *scratch;              // 2 * n_words for the bitset propagator
+    PropagationPool *pool;          // band threads for WFC_PROPAGATE_PARALLEL, NULL otherwise
+    size_t parallel_threshold;      // cells a cascade revisits serially before the bands take over
 
-        bool done_propagating = true;
-        for (size_t i = 0; i < output_grid_size; ++i)
-        {
-            if (changed[i])
-            {
-                current_idx = i;
-                done_propagating = false;
-                break;
-            }
-        }
-        if (done_propagating)
-        {
-            bool more_left = false;
-            // Pick new starting index
-            for (size_t i = 0; i < output_grid_size; ++i)
-            {
-                // printf("counts for %lu: %lu\n", i, counts[i]);
-                if (counts[i] > 1)
-                {
-                    more_left = true;
-                    current_idx = i;
-                    for (size_t j = 0; j < n_patterns; ++j)
-                    {
-                        if (output_grid[current_idx][j])
-                        {
-                            memset(output_grid[current_idx], 0, n_patterns * sizeof(bool));
-                            output_grid[current_idx][j] = true;
-                            counts[current_idx] = 1;
-                            pattern_nos[current_idx] = j;
-                        }
-                    }
-                    break;
-                }
-            }
-            if(!more_left)
-            {
-                break;
-            }            
-        }
-    }
-    for (size_t i = 0; i < output_grid_width; ++i)
-    {
-        for (size_t j = 0; j < output_grid_height; ++j)
-        {
-            size_t pattern_no = pattern_nos[j * output_grid_width + i];
+    // AC-4: supports[(cell * n_patterns + pattern) * N_DIRECTIONS + d] counts
+    // the patterns still possible in the neighbour in direction d that allow
+    // this pattern. A pattern whose count drops to zero is banned.
+    uint32_t *supports;
+    Ban *bans;                      // at most one per cell and pattern
+    size_t n_bans;
+    bool contradiction;
 
-            if(pattern_no >= n_patterns)
-            {
-                printf("bad pattern at pos (%lu, %lu) no: %lu    count: %lu\n", i , j, pattern_no, counts[j * output_grid_width + i]);
-                exit(1);
-            } 
-            Pattern pattern = patterns[pattern_no];
-            
-            if (j == output_grid_height - 1 && i == output_grid_width - 1)
-            {
-                for (size_t x = 0; x < pattern_size ;++x)
-                {
-                    for (size_t y = 0; y < pattern_size; ++y)
-                    {
-                        result[(i + x) + output_grid_width *(j + y)] = pattern.values[y * pattern_size + x];
-                    }
-                }
-            }
-            else if (j == output_grid_height - 1)
-            {
-                for (size_t y = 0; y < pattern_size; ++y)
-                    {
-                        result[(i) + output_grid_width *(j + y)] = pattern.values[y * pattern_size];
-                    }
-            }
-            else if (i == output_grid_width - 1)
-            {
-                for (size_t x = 0; x < pattern_size; ++x)
-                    {
-                        result[(i + x) + output_grid_width *(j)] = pattern.values[x];
-                    }
-            }
-            else
-            {
-                result[(i) + output_grid_width *(j)] = pattern.values[0];
-            }
+    // Observation: per-cell sums of the weights of the live patterns give
+    // the Shannon entropy, and a min-heap keyed on it (plus a little noise
+    // to break ties) yields the next cell to collapse
+    const uint32_t *weights;
+    const int64_t *weight_log_weights;
+    uint64_t *sum_weights;
+    int64_t *sum_weight_log_weights;
+    double *noise;
+    double *entropies;
+    size_t *heap;                   // undecided cells, lowest entropy first
+    size_t *heap_pos;               // position of each cell in heap, SIZE_MAX once decided
+    size_t heap_size;
 
+    // Backtracking only: every removal since the wave was initialised, and
+    // the observations made along the way. NULL when not backtracking.
+    // A pattern leaves a cell at most once, so size * n_patterns bounds the trail.
+    Ban *trail;
+    size_t trail_size;
+    Decision *decisions;
+    size_t n_decisions;
+
+    SolveCounters counters;         // across every attempt the wave runs in a job
+    bool timed;                     // time propagation and observation too
+} Wave;
+
+
+internal uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+internal size_t
+wave_neighbour(const Wave *wave, const size_t cell, const int direction)
+{
+    if (wave->periodic) {
+        const size_t x = cell % wave->width;
+        switch (direction) {
+            case 0: return cell >= wave->width ? cell - wave->width : cell + wave->size - wave->width;
+            case 1: return x ? cell - 1 : cell + wave->width - 1;
+            case 2: return x != wave->width - 1 ? cell + 1 : cell - x;
+            case 3: return cell < wave->size - wave->width ? cell + wave->width : cell - (wave->size - wave->width);
+            default: return SIZE_MAX;
         }
     }
 
-    for (size_t i = 0; i < output_width; ++i)
-    {
-        putchar('\n');
-        for (size_t j = 0; j < output_height; ++j)
-        {
-            printf("%02u ", result[(i) + output_grid_width *(j)]);
+    switch (direction) {
+        case 0: return cell >= wave->width ? cell - wave->width : SIZE_MAX;
+        case 1: return cell % wave->width ? cell - 1 : SIZE_MAX;
+        case 2: return (cell % wave->width) != (wave->width - 1) ? cell + 1 : SIZE_MAX;
+        case 3: return cell < wave->size - wave->width ? cell + wave->width : SIZE_MAX;
+        default: return SIZE_MAX;
+    }
+}
 
-        }
+
+internal void
+wave_push(Wave *wave, const size_t cell)
+{
+    if (!wave->changed[cell]) {
+        wave->changed[cell] = true;
+        wave->stack[wave->stack_size++] = cell;
     }
-    putchar('\n');
+}
 
-    
-cleanup:
-    for (size_t i = 0; i < n_patterns * N_DIRECTIONS; ++i) 
-        patternlist_free(rules[i]);
 
-    for (size_t i = 0; i < max_patterns; ++i) 
-        free(patterns[i].values);
+internal double
+wave_entropy(const Wave *wave, const size_t cell)
+{
+    double sum = (double)wave->sum_weights[cell];
+    double sum_weight_log_weights = wave->sum_weight_log_weights[cell] / ENTROPY_FIXED_POINT_SCALE;
+    return log(sum) - sum_weight_log_weights / sum + wave->noise[cell];
+}
 
-    free(patterns);
-    return result;
+
+internal bool
+heap_less(const Wave *wave, const size_t a, const size_t b)
+{
+    double entropy_a = wave->entropies[a];
+    double entropy_b = wave->entropies[b];
+    return entropy_a < entropy_b || (entropy_a == entropy_b && a < b);
 }
 
 
+internal void
+heap_swap(Wave *wave, const size_t i, const size_t j)
+{
+    size_t a = wave->heap[i];
+    size_t b = wave->heap[j];
+    wave->heap[i] = b;
+    wave->heap[j] = a;
+    wave->heap_pos[b] = i;
+    wave->heap_pos[a] = j;
+}
 
 
+internal void
+heap_sift_up(Wave *wave, size_t i)
+{
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!heap_less(wave, wave->heap[i], wave->heap[parent]))
+            break;
+        heap_swap(wave, i, parent);
+        i = parent;
+    }
+}
+
+
+internal void
+heap_sift_down(Wave *wave, size_t i)
+{
+    while (1) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < wave->heap_size && heap_less(wave, wave->heap[left], wave->heap[smallest]))
+            smallest = left;
+        if (right < wave->heap_size && heap_less(wave, wave->heap[right], wave->heap[smallest]))
+            smallest = right;
+        if (smallest == i)
+            break;
+        heap_swap(wave, i, smallest);
+        i = smallest;
+    }
+}
+
+
+// Re-key a cell after its possibilities changed. Cells down to a single
+// pattern (or none) leave the heap, and cells reopened by backtracking
+// rejoin it.
+internal void
+heap_update(Wave *wave, const size_t cell)
+{
+    size_t i = wave->heap_pos[cell];
+
+    if (wave->counts[cell] <= 1) {
+        if (i == SIZE_MAX)
+            return;
+        size_t last = --wave->heap_size;
+        wave->heap_pos[cell] = SIZE_MAX;
+        if (i != last) {
+            size_t moved = wave->heap[last];
+            wave->heap[i] = moved;
+            wave->heap_pos[moved] = i;
+            heap_sift_down(wave, i);
+            heap_sift_up(wave, wave->heap_pos[moved]);
+        }
+        return;
+    }
+
+    if (i == SIZE_MAX) {
+        i = wave->heap_size++;
+        wave->heap[i] = cell;
+        wave->heap_pos[cell] = i;
+    }
+    wave->entropies[cell] = wave_entropy(wave, cell);
+    heap_sift_up(wave, i);
+    heap_sift_down(wave, wave->heap_pos[cell]);
+}
+
+
+// Account for a pattern that has just been cleared from a cell's bitset
+internal void
+wave_removed(Wave *wave, const size_t cell, const size_t pattern)
+{
+    wave->sum_weights[cell] -= wave->weights[pattern];
+    wave->sum_weight_log_weights[cell] -= wave->weight_log_weights[pattern];
+    wave->counters.n_bans++;
+
+    if (wave->trail)
+        wave->trail[wave->trail_size++] = (Ban){.cell = cell, .pattern = pattern};
+}
+
+
+// Remove one pattern from a cell and queue it for propagation
+internal void
+wave_ban(Wave *wave, const size_t cell, const size_t pattern)
+{
+    uint64_t *set = wave->cells + cell * wave->n_words;
+    bitset_clear(set, pattern);
+    wave_removed(wave, cell, pattern);
+
+    size_t count = --wave->counts[cell];
+    if (count == 1)
+        wave->pattern_nos[cell] = bitset_first(set, wave->n_words);
+    else if (count == 0)
+        wave->contradiction = true;
+    heap_update(wave, cell);
+
+    if (wave->propagator != WFC_PROPAGATE_AC4) {
+        wave_push(wave, cell);
+        return;
+    }
+
+    wave->bans[wave->n_bans++] = (Ban){.cell = cell, .pattern = pattern};
+}
+
+
+// Add (delta = +1) or remove (delta = -1) the support a pattern in a cell
+// gives to the patterns it allows in each neighbouring cell
+internal void
+ac4_adjust_supports(Wave *wave, const Ban ban, const int delta)
+{
+    for (int d = 0; d < N_DIRECTIONS; ++d) {
+        size_t adj_idx = wave_neighbour(wave, ban.cell, d);
+        if (adj_idx == SIZE_MAX)
+            continue;
+
+        const Rules *rules = wave->rules;
+        size_t r = ban.pattern * N_DIRECTIONS + d;
+        uint32_t *adj_supports = wave->supports + adj_idx * wave->n_patterns * N_DIRECTIONS;
+        for (uint32_t j = rules->offsets[r]; j < rules->offsets[r + 1]; ++j)
+            adj_supports[rules->patterns[j] * N_DIRECTIONS + (N_DIRECTIONS - 1 - d)] += delta;
+    }
+}
+
+
+internal void
+wave_init(Wave *wave)
+{
+    uint64_t sum_weights = 0;
+    int64_t sum_weight_log_weights = 0;
+    for (size_t p = 0; p < wave->n_patterns; ++p) {
+        sum_weights += wave->weights[p];
+        sum_weight_log_weights += wave->weight_log_weights[p];
+    }
+
+    for (size_t i = 0; i < wave->size; ++i) {
+        bitset_fill(wave->cells + i * wave->n_words, wave->n_patterns);
+        wave->counts[i] = wave->n_patterns;
+        wave->changed[i] = false;
+        wave->pattern_nos[i] = wave->n_patterns == 1 ? 0 : SIZE_MAX;
+        wave->sum_weights[i] = sum_weights;
+        wave->sum_weight_log_weights[i] = sum_weight_log_weights;
+        wave->noise[i] = rand_unit(&wave->rng) * ENTROPY_NOISE;
+        wave->entropies[i] = wave_entropy(wave, i);
+        wave->heap[i] = i;
+        wave->heap_pos[i] = i;
+    }
+    wave->heap_size = wave->n_patterns > 1 ? wave->size : 0;
+    for (size_t i = wave->heap_size / 2; i-- > 0;)
+        heap_sift_down(wave, i);
+    if (!wave->heap_size)
+        for (size_t i = 0; i < wave->size; ++i)
+            wave->heap_pos[i] = SIZE_MAX;
+
+    wave->stack_size = 0;
+    wave->n_bans = 0;
+    wave->contradiction = false;
+    wave->trail_size = 0;
+    wave->n_decisions = 0;
+
+    if (wave->propagator == WFC_PROPAGATE_AC4) {
+        for (size_t i = 0; i < wave->size; ++i) {
+            for (size_t p = 0; p < wave->n_patterns; ++p) {
+                uint32_t *support = wave->supports + (i * wave->n_patterns + p) * N_DIRECTIONS;
+                for (int d = 0; d < N_DIRECTIONS; ++d)
+                    support[d] = rules_count(wave->rules, p * N_DIRECTIONS + d);
+            }
+        }
+    }
+
+    // A pattern that nothing may sit next to can't go anywhere that has a
+    // neighbour in that direction. Nothing else would ever remove it (its
+    // AC-4 counter starts at zero rather than reaching it, and the bitset
+    // propagator only revisits cells whose neighbours changed), so it is
+    // banned up front and propagation carries on from there. Open edges of
+    // a wave that is only part of the output count as having neighbours.
+    for (size_t i = 0; i < wave->size; ++i) {
+        for (size_t p = 0; p < wave->n_patterns; ++p) {
+            for (int d = 0; d < N_DIRECTIONS; ++d) {
+                bool bordered = wave_neighbour(wave, i, d) != SIZE_MAX || (wave->open_edges >> d & 1);
+                if (bordered && rules_count(wave->rules, p * N_DIRECTIONS + d) == 0) {
+                    wave_ban(wave, i, p);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Constrained cells lose whatever their constraints rule out
+    if (wave->allowed) {
+        for (size_t i = 0; i < wave->size; ++i) {
+            const uint64_t *set = wave->cells + i * wave->n_words;
+            const uint64_t *allowed = wave->allowed + i * wave->n_words;
+            for (size_t w = 0; w < wave->n_words; ++w) {
+                uint64_t banned = set[w] & ~allowed[w];
+                while (banned) {
+                    wave_ban(wave, i, w * BITSET_WORD_BITS + __builtin_ctzll(banned));
+                    banned &= banned - 1;
+                }
+            }
+        }
+    }
+
+    // Pinned cells (such as the borders shared with finished tiles when
+    // generating in chunks) keep only their pinned pattern
+    if (wave->pins) {
+        for (size_t i = 0; i < wave->size; ++i) {
+            if (wave->pins[i] == SIZE_MAX)
+                continue;
+            const uint64_t *set = wave->cells + i * wave->n_words;
+            for (size_t p = 0; p < wave->n_patterns; ++p)
+                if (p != wave->pins[i] && bitset_test(set, p))
+                    wave_ban(wave, i, p);
+        }
+    }
+}
+
+
+// Restrict a cell to a single pattern and queue it for propagation
+internal void
+wave_collapse(Wave *wave, const size_t cell, const size_t pattern)
+{
+    uint64_t *set = wave->cells + cell * wave->n_words;
+
+    if (wave->propagator == WFC_PROPAGATE_AC4) {
+        for (size_t w = 0; w < wave->n_words; ++w) {
+            uint64_t live = set[w] & ~((w == pattern / BITSET_WORD_BITS) ? (uint64_t)1 << (pattern % BITSET_WORD_BITS) : 0);
+            while (live) {
+                size_t p = w * BITSET_WORD_BITS + __builtin_ctzll(live);
+                live &= live - 1;
+                wave_ban(wave, cell, p);
+            }
+        }
+        return;
+    }
+
+    for (size_t w = 0; w < wave->n_words; ++w) {
+        uint64_t removed = set[w] & ~((w == pattern / BITSET_WORD_BITS) ? (uint64_t)1 << (pattern % BITSET_WORD_BITS) : 0);
+        while (removed) {
+            wave_removed(wave, cell, w * BITSET_WORD_BITS + __builtin_ctzll(removed));
+            removed &= removed - 1;
+        }
+    }
+    memset(set, 0, wave->n_words * sizeof(uint64_t));
+    bitset_set(set, pattern);
+    wave->counts[cell] = 1;
+    wave->pattern_nos[cell] = pattern;
+    heap_update(wave, cell);
+    wave_push(wave, cell);
+}
+
+
+// Collapse the undecided cell with the lowest entropy to one of its live
+// patterns, picked with probability proportional to the pattern weights.
+// Returns false once every cell is decided.
+internal bool
+wave_observe(Wave *wave)
+{
+    if (!wave->heap_size)
+        return false;
+
+    size_t cell = wave->heap[0];
+    const uint64_t *set = wave->cells + cell * wave->n_words;
+    uint64_t target = (uint64_t)(rand_unit(&wave->rng) * wave->sum_weights[cell]);
+    size_t chosen = SIZE_MAX;
+
+    for (size_t w = 0; w < wave->n_words && chosen == SIZE_MAX; ++w) {
+        uint64_t live = set[w];
+        while (live) {
+            size_t p = w * BITSET_WORD_BITS + __builtin_ctzll(live);
+            live &= live - 1;
+            chosen = p;
+            if (target < wave->weights[p])
+                break;
+            target -= wave->weights[p];
+        }
+    }
+
+    wave->counters.n_observations++;
+    if (wave->decisions)
+        wave->decisions[wave->n_decisions++] = (Decision){
+            .trail_size = wave->trail_size, .cell = cell, .pattern = chosen
+        };
+
+    wave_collapse(wave, cell, chosen);
+    return true;
+}
+
+
+// The union of the rule masks in direction d of the patterns still possible
+// in a cell: everything its neighbour that way may still be
+internal void
+cell_support(const Wave *wave, const uint64_t *cell, const int d, uint64_t *support)
+{
+    const size_t n_words = wave->n_words;
+    memset(support, 0, n_words * sizeof(uint64_t));
+
+    for (size_t w = 0; w < n_words; ++w) {
+        uint64_t live = cell[w];
+        while (live) {
+            size_t i = w * BITSET_WORD_BITS + __builtin_ctzll(live);
+            live &= live - 1;
+            bitset_or(support, wave->rule_masks + (i * N_DIRECTIONS + d) * n_words, n_words);
+        }
+    }
+}
+
+
+internal bool propagate_parallel(Wave *wave);
+
+
+// Revisit every queued cell, intersecting each neighbour with the union of
+// the rule masks of the patterns still possible in the cell. Cascades that
+// grow past the wave's threshold (PARALLEL_PROPAGATION_THRESHOLD cells
+// unless the options set one) are finished by the band threads when the
+// wave has them.
+internal bool
+propagate_bitset(Wave *wave)
+{
+    const size_t n_words = wave->n_words;
+    size_t n_visited = 0;
+
+    if (wave->contradiction)
+        return false;
+
+    while (wave->stack_size) {
+        if (wave->pool && ++n_visited > wave->parallel_threshold)
+            return propagate_parallel(wave);
+
+        size_t current_idx = wave->stack[--wave->stack_size];
+        const uint64_t *current = wave->cells + current_idx * n_words;
+        wave->changed[current_idx] = false;
+        wave->counters.n_propagations++;
+
+        for (int x = 0; x < N_DIRECTIONS; ++x) {
+            size_t adj_idx = wave_neighbour(wave, current_idx, x);
+            if (adj_idx == SIZE_MAX)
+                continue;
+            wave->counters.n_cells_visited++;
+
+            assert(adj_idx < wave->size && "Bad adj idx");
+
+            uint64_t *possible_adj_patterns = wave->scratch;
+            cell_support(wave, current, x, possible_adj_patterns);
+
+            uint64_t *adj = wave->cells + adj_idx * n_words;
+            uint64_t *before = wave->scratch + n_words;
+            memcpy(before, adj, n_words * sizeof(uint64_t));
+            size_t new_count = bitset_and_count(adj, possible_adj_patterns, n_words);
+
+            if (new_count != wave->counts[adj_idx]) {
+                for (size_t w = 0; w < n_words; ++w) {
+                    uint64_t removed = before[w] & ~adj[w];
+                    while (removed) {
+                        wave_removed(wave, adj_idx, w * BITSET_WORD_BITS + __builtin_ctzll(removed));
+                        removed &= removed - 1;
+                    }
+                }
+                if (new_count == 1)
+                    wave->pattern_nos[adj_idx] = bitset_first(adj, n_words);
+                wave->counts[adj_idx] = new_count;
+                heap_update(wave, adj_idx);
+                wave_push(wave, adj_idx);
+            }
+
+            if (!new_count)
+                return false;
+        }
+    }
+    return true;
+}
+
+
+// Process queued bans, removing the support each banned pattern gave to the
+// patterns it allowed next to it and banning any left with no support
+internal bool
+propagate_ac4(Wave *wave)
+{
+    while (wave->n_bans && !wave->contradiction) {
+        Ban ban = wave->bans[--wave->n_bans];
+        wave->counters.n_propagations++;
+
+        for (int d = 0; d < N_DIRECTIONS; ++d) {
+            size_t adj_idx = wave_neighbour(wave, ban.cell, d);
+            if (adj_idx == SIZE_MAX)
+                continue;
+            wave->counters.n_cells_visited++;
+
+            const uint64_t *adj = wave->cells + adj_idx * wave->n_words;
+            const Rules *rules = wave->rules;
+            size_t r = ban.pattern * N_DIRECTIONS + d;
+            uint32_t *adj_supports = wave->supports + adj_idx * wave->n_patterns * N_DIRECTIONS;
+
+            for (uint32_t j = rules->offsets[r]; j < rules->offsets[r + 1]; ++j) {
+                size_t q = rules->patterns[j];
+                if (--adj_supports[q * N_DIRECTIONS + (N_DIRECTIONS - 1 - d)] == 0 && bitset_test(adj, q))
+                    wave_ban(wave, adj_idx, q);
+            }
+        }
+    }
+    return !wave->contradiction;
+}
+
+
+// Parallel propagation splits the wave into horizontal bands of rows, one
+// per thread. A thread only ever writes the cells of its own band; when a
+// cell on a band edge changes, the support it leaves its neighbour across
+// the edge is sent to the thread owning that neighbour through a
+// single-producer single-consumer queue. Arc consistency has a unique fixed
+// point, so the bands reach exactly the state serial propagation would.
+// Removals are recorded (weights, trail, heap) serially afterwards from a
+// snapshot of every cell the pass touched.
+
+typedef struct SupportQueue
+{
+    uint64_t *slots;                // capacity messages of (cell, n_words support words)
+    size_t capacity;                // power of two
+    _Alignas(64) atomic_size_t head;    // advanced by the consumer
+    _Alignas(64) atomic_size_t tail;    // advanced by the producer
+} SupportQueue;
+
+
+typedef struct Region
+{
+    Wave *wave;
+    size_t *stack;                  // queued cells, all from this band
+    size_t stack_size;
+    size_t *touched;                // cells changed in this pass, all from this band
+    size_t n_touched;
+    uint64_t *scratch;              // 2 * n_words
+    SupportQueue *to_up, *to_down;      // outgoing, NULL on the first and last band
+    SupportQueue *from_up, *from_down;  // incoming
+    bool busy;
+    uint64_t n_visited, n_neighbours;   // counted here, added to the wave's after each pass
+} Region;
+
+
+struct PropagationPool
+{
+    unsigned int n_regions;
+    Region *regions;
+    unsigned int *row_region;       // owning band of each row
+    pthread_t *threads;             // n_regions - 1; the wave's own thread runs the first band
+    uint64_t *snapshot;             // bitsets of touched cells as they were when the pass started
+    bool *touched;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    unsigned int generation, n_finished;
+    bool stop;
+
+    // Termination: busy bands plus messages in flight. Senders count a
+    // message before queueing it and receivers count themselves busy before
+    // uncounting it, so this only reaches zero once the fixed point is.
+    atomic_size_t pending;
+    atomic_bool contradiction;
+};
+
+
+internal const uint64_t *
+queue_peek(SupportQueue *queue, const size_t n_words)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&queue->tail, memory_order_acquire))
+        return NULL;
+    return queue->slots + (head & (queue->capacity - 1)) * (1 + n_words);
+}
+
+
+internal void
+queue_advance(SupportQueue *queue)
+{
+    atomic_store_explicit(&queue->head, atomic_load_explicit(&queue->head, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+
+internal bool
+queue_push(SupportQueue *queue, const size_t cell, const uint64_t *support, const size_t n_words)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == queue->capacity)
+        return false;
+
+    uint64_t *slot = queue->slots + (tail & (queue->capacity - 1)) * (1 + n_words);
+    slot[0] = cell;
+    memcpy(slot + 1, support, n_words * sizeof(uint64_t));
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+
+internal void
+region_set_busy(Region *region)
+{
+    if (!region->busy) {
+        region->busy = true;
+        atomic_fetch_add(&region->wave->pool->pending, 1);
+    }
+}
+
+
+// Intersect a cell of this band with a support, queueing it if it shrank
+internal void
+region_restrict(Region *region, const size_t cell, const uint64_t *support)
+{
+    Wave *wave = region->wave;
+    PropagationPool *pool = wave->pool;
+    const size_t n_words = wave->n_words;
+    uint64_t *bits = wave->cells + cell * n_words;
+    uint64_t *before = region->scratch + n_words;
+
+    memcpy(before, bits, n_words * sizeof(uint64_t));
+    size_t new_count = bitset_and_count(bits, support, n_words);
+    if (new_count == wave->counts[cell])
+        return;
+
+    if (!pool->touched[cell]) {
+        pool->touched[cell] = true;
+        memcpy(pool->snapshot + cell * n_words, before, n_words * sizeof(uint64_t));
+        region->touched[region->n_touched++] = cell;
+    }
+    wave->counts[cell] = new_count;
+    if (new_count == 0)
+        atomic_store_explicit(&pool->contradiction, true, memory_order_relaxed);
+    if (!wave->changed[cell]) {
+        wave->changed[cell] = true;
+        region->stack[region->stack_size++] = cell;
+    }
+}
+
+
+// Apply every support waiting for this band. Returns whether there were any.
+internal bool
+region_receive(Region *region)
+{
+    const size_t n_words = region->wave->n_words;
+    SupportQueue *queues[2] = {region->from_up, region->from_down};
+    bool received = false;
+
+    for (int i = 0; i < 2; ++i) {
+        if (queues[i] == NULL)
+            continue;
+        const uint64_t *message;
+        while ((message = queue_peek(queues[i], n_words))) {
+            region_set_busy(region);
+            region_restrict(region, message[0], message + 1);
+            queue_advance(queues[i]);
+            atomic_fetch_sub(&region->wave->pool->pending, 1);
+            received = true;
+        }
+    }
+    return received;
+}
+
+
+internal void
+region_send(Region *region, SupportQueue *queue, const size_t cell, const uint64_t *support)
+{
+    PropagationPool *pool = region->wave->pool;
+    atomic_fetch_add(&pool->pending, 1);
+
+    // Taking in our own messages while waiting means two bands filling each
+    // other's queues can't wait on each other forever
+    while (!queue_push(queue, cell, support, region->wave->n_words)) {
+        if (atomic_load_explicit(&pool->contradiction, memory_order_relaxed))
+            return;
+        if (!region_receive(region))
+            sched_yield();
+    }
+}
+
+
+internal void
+region_visit(Region *region, const size_t cell)
+{
+    Wave *wave = region->wave;
+    const uint64_t *current = wave->cells + cell * wave->n_words;
+    uint64_t *support = region->scratch;
+    wave->changed[cell] = false;
+
+    for (int d = 0; d < N_DIRECTIONS; ++d) {
+        size_t adj_idx = wave_neighbour(wave, cell, d);
+        if (adj_idx == SIZE_MAX)
+            continue;
+        region->n_neighbours++;
+
+        cell_support(wave, current, d, support);
+        unsigned int owner = wave->pool->row_region[adj_idx / wave->width];
+        if (owner == wave->pool->row_region[cell / wave->width])
+            region_restrict(region, adj_idx, support);
+        else
+            region_send(region, d == 0 ? region->to_up : region->to_down, adj_idx, support);
+    }
+}
+
+
+internal void
+region_propagate(Region *region)
+{
+    PropagationPool *pool = region->wave->pool;
+
+    while (!atomic_load_explicit(&pool->contradiction, memory_order_relaxed)) {
+        if (region_receive(region))
+            continue;
+        if (region->stack_size) {
+            region_set_busy(region);
+            region_visit(region, region->stack[--region->stack_size]);
+            region->n_visited++;
+            continue;
+        }
+        if (region->busy) {
+            region->busy = false;
+            atomic_fetch_sub(&pool->pending, 1);
+        }
+        if (atomic_load(&pool->pending) == 0)
+            break;
+        sched_yield();
+    }
+}
+
+
+internal void *
+pool_thread(void *arg)
+{
+    Region *region = arg;
+    PropagationPool *pool = region->wave->pool;
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->generation == seen && !pool->stop)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stop)
+            break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        region_propagate(region);
+
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->n_finished == pool->n_regions - 1)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+internal void
+pool_stop(Wave *wave)
+{
+    PropagationPool *pool = wave->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned int i = 1; i < pool->n_regions; ++i)
+        pthread_join(pool->threads[i - 1], NULL);
+
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+
+// Start a thread for every band after the first, which the wave's own
+// thread runs. Returns false if they could not all be started, in which
+// case the wave propagates serially.
+internal bool
+pool_start(Wave *wave)
+{
+    PropagationPool *pool = wave->pool;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->generation = 0;
+    pool->stop = false;
+
+    unsigned int n_regions = pool->n_regions;
+    for (unsigned int i = 1; i < n_regions; ++i) {
+        if (pthread_create(&pool->threads[i - 1], NULL, pool_thread, &pool->regions[i]) != 0) {
+            pool->n_regions = i;
+            pool_stop(wave);
+            pool->n_regions = n_regions;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Finish the cascade on the stack with every band working at once
+internal bool
+propagate_parallel(Wave *wave)
+{
+    PropagationPool *pool = wave->pool;
+    const size_t n_words = wave->n_words;
+    wave->counters.n_parallel_passes++;
+
+    while (wave->stack_size) {
+        size_t cell = wave->stack[--wave->stack_size];
+        Region *region = &pool->regions[pool->row_region[cell / wave->width]];
+        region->stack[region->stack_size++] = cell;
+    }
+
+    size_t n_busy = 0;
+    for (unsigned int i = 0; i < pool->n_regions; ++i) {
+        pool->regions[i].busy = pool->regions[i].stack_size > 0;
+        n_busy += pool->regions[i].busy;
+    }
+    atomic_store(&pool->pending, n_busy);
+    atomic_store(&pool->contradiction, false);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->generation++;
+    pool->n_finished = 0;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    region_propagate(&pool->regions[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->n_finished < pool->n_regions - 1)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    // Record what the pass removed, and clear up after a pass cut short
+    bool contradiction = atomic_load(&pool->contradiction);
+    for (unsigned int i = 0; i < pool->n_regions; ++i) {
+        Region *region = &pool->regions[i];
+        while (region->stack_size)
+            wave->changed[region->stack[--region->stack_size]] = false;
+        wave->counters.n_propagations += region->n_visited;
+        wave->counters.n_cells_visited += region->n_neighbours;
+        region->n_visited = 0;
+        region->n_neighbours = 0;
+
+        SupportQueue *queues[2] = {region->from_up, region->from_down};
+        for (int q = 0; q < 2; ++q)
+            if (queues[q])
+                atomic_store(&queues[q]->head, atomic_load(&queues[q]->tail));
+
+        for (size_t t = 0; t < region->n_touched; ++t) {
+            size_t cell = region->touched[t];
+            const uint64_t *before = pool->snapshot + cell * n_words;
+            const uint64_t *after = wave->cells + cell * n_words;
+            for (size_t w = 0; w < n_words; ++w) {
+                uint64_t removed = before[w] & ~after[w];
+                while (removed) {
+                    wave_removed(wave, cell, w * BITSET_WORD_BITS + __builtin_ctzll(removed));
+                    removed &= removed - 1;
+                }
+            }
+            if (wave->counts[cell] == 1)
+                wave->pattern_nos[cell] = bitset_first(after, n_words);
+            heap_update(wave, cell);
+            pool->touched[cell] = false;
+        }
+        region->n_touched = 0;
+    }
+
+    if (contradiction)
+        wave->contradiction = true;
+    return !contradiction;
+}
+
+
+internal bool
+wave_propagate(Wave *wave)
+{
+    return wave->propagator == WFC_PROPAGATE_AC4 ? propagate_ac4(wave) : propagate_bitset(wave);
+}
+
+
+// Roll the wave back to the point where the trail was trail_size long
+internal void
+wave_undo(Wave *wave, const size_t trail_size)
+{
+    if (wave->propagator == WFC_PROPAGATE_AC4) {
+        // Bans still queued never had their support removed. Remove it now
+        // so that every ban on the trail can be undone the same way.
+        while (wave->n_bans)
+            ac4_adjust_supports(wave, wave->bans[--wave->n_bans], -1);
+    }
+    while (wave->stack_size)
+        wave->changed[wave->stack[--wave->stack_size]] = false;
+    wave->contradiction = false;
+
+    while (wave->trail_size > trail_size) {
+        Ban ban = wave->trail[--wave->trail_size];
+
+        bitset_set(wave->cells + ban.cell * wave->n_words, ban.pattern);
+        wave->sum_weights[ban.cell] += wave->weights[ban.pattern];
+        wave->sum_weight_log_weights[ban.cell] += wave->weight_log_weights[ban.pattern];
+
+        size_t count = ++wave->counts[ban.cell];
+        if (count == 1)
+            wave->pattern_nos[ban.cell] = ban.pattern;
+        else if (count == 2)
+            wave->pattern_nos[ban.cell] = SIZE_MAX;
+        heap_update(wave, ban.cell);
+
+        if (wave->propagator == WFC_PROPAGATE_AC4)
+            ac4_adjust_supports(wave, ban, +1);
+    }
+}
+
+
+// Undo observations until one can be ruled out without contradiction:
+// the most recent observation is taken back and the pattern it chose is
+// banned from its cell instead. Returns false when there is nothing left
+// to take back or the backtrack budget is spent.
+internal bool
+wave_backtrack(Wave *wave, const unsigned int max_backtracks, unsigned int *backtracks)
+{
+    while (wave->n_decisions) {
+        if (max_backtracks && *backtracks >= max_backtracks)
+            return false;
+        (*backtracks)++;
+
+        Decision decision = wave->decisions[--wave->n_decisions];
+        wave_undo(wave, decision.trail_size);
+        wave_ban(wave, decision.cell, decision.pattern);
+
+        if (wave_propagate(wave))
+            return true;
+    }
+    return false;
+}
+
+
+// The preview is triple buffered: the solver draws into back and swaps it
+// with middle, and the reader swaps front with middle whenever middle holds
+// a preview it hasn't seen. Neither side ever waits for the other.
+#define MONITOR_FRESH 4u
+
+struct WfcMonitor
+{
+    unsigned int output_width, output_height;
+    uint64_t interval_ns;
+    atomic_bool cancelled;
+    _Atomic uint64_t next_publish;  // now_ns() time the next preview is due
+    atomic_flag publishing;         // held by the attempt drawing into back
+    uint32_t *buffers;              // 3 * output_width * output_height
+    unsigned int back, front;
+    atomic_uint middle;             // buffer index, | MONITOR_FRESH until read
+    bool has_preview;               // the reader has taken one
+};
+
+
+WfcStatus wfc_monitor_create(const unsigned int output_width, const unsigned int output_height,
+                             const unsigned int interval_ms, WfcMonitor **result)
+{
+    if (output_width == 0 || output_height == 0)
+        return WFC_BAD_INPUT;
+
+    WfcMonitor *monitor = malloc(sizeof(WfcMonitor));
+    if (monitor == NULL)
+        return WFC_OUT_OF_MEMORY;
+    monitor->buffers = malloc(3 * (size_t)output_width * output_height * sizeof(uint32_t));
+    if (monitor->buffers == NULL) {
+        free(monitor);
+        return WFC_OUT_OF_MEMORY;
+    }
+
+    monitor->output_width = output_width;
+    monitor->output_height = output_height;
+    monitor->interval_ns = (uint64_t)interval_ms * 1000000;
+    atomic_init(&monitor->cancelled, false);
+    atomic_init(&monitor->next_publish, 0);
+    atomic_flag_clear(&monitor->publishing);
+    monitor->has_preview = false;
+    monitor->back = 0;
+    monitor->front = 1;
+    atomic_init(&monitor->middle, 2);
+    *result = monitor;
+    return WFC_OK;
+}
+
+
+void wfc_monitor_free(WfcMonitor *monitor)
+{
+    if (monitor == NULL)
+        return;
+    free(monitor->buffers);
+    free(monitor);
+}
+
+
+void wfc_monitor_cancel(WfcMonitor *monitor)
+{
+    atomic_store(&monitor->cancelled, true);
+}
+
+
+const uint32_t *wfc_monitor_preview(WfcMonitor *monitor)
+{
+    if (atomic_load(&monitor->middle) & MONITOR_FRESH) {
+        unsigned int middle = atomic_exchange(&monitor->middle, monitor->front);
+        monitor->front = middle & ~MONITOR_FRESH;
+        monitor->has_preview = true;
+    }
+    if (!monitor->has_preview)
+        return NULL;
+    return monitor->buffers + (size_t)monitor->front * monitor->output_width * monitor->output_height;
+}
+
+
+// Colour of output pixel (x, y) as the wave stands: the pattern's if the
+// placement drawing it is decided, otherwise the average of every pattern
+// it could still be, channel by channel
+internal uint32_t
+wave_preview_pixel(const Wave *wave, const size_t x, const size_t y)
+{
+    const WfcModel *model = wave->model;
+    size_t cell, offset;
+    if (model->tile_size) {
+        const size_t tile_size = model->tile_size;
+        cell = (y / tile_size) * wave->width + x / tile_size;
+        offset = (y % tile_size) * tile_size + x % tile_size;
+    } else {
+        size_t u = x, v = y;
+        if (!wave->periodic) {
+            u = x < wave->width ? x : wave->width - 1;
+            v = y < wave->height ? y : wave->height - 1;
+        }
+        cell = v * wave->width + u;
+        offset = (y - v) * model->pattern_size + (x - u);
+    }
+
+    const size_t n_values = model->tile_size ? (size_t)model->tile_size * model->tile_size
+                                             : (size_t)model->pattern_size * model->pattern_size;
+#define PATTERN_COLOUR(p) (model->tile_size ? model->tiles[(p) * n_values + offset] \
+                                            : model->palette[model->values[(p) * n_values + offset]])
+    if (wave->pattern_nos[cell] != SIZE_MAX)
+        return PATTERN_COLOUR(wave->pattern_nos[cell]);
+
+    const uint64_t *set = wave->cells + cell * wave->n_words;
+    uint64_t sums[4] = {0};
+    size_t n = 0;
+    for (size_t w = 0; w < wave->n_words; ++w) {
+        for (uint64_t bits = set[w]; bits; bits &= bits - 1) {
+            uint32_t colour = PATTERN_COLOUR(w * BITSET_WORD_BITS + __builtin_ctzll(bits));
+            for (int c = 0; c < 4; ++c)
+                sums[c] += colour >> (8 * c) & 0xFF;
+            n++;
+        }
+    }
+#undef PATTERN_COLOUR
+    if (n == 0)
+        return 0x000000FF;
+
+    uint32_t colour = 0;
+    for (int c = 0; c < 4; ++c)
+        colour |= (uint32_t)(sums[c] / n) << (8 * c);
+    return colour;
+}
+
+
+// Called between observations. Publishes a preview if one is due and no
+// other attempt is already drawing one; false if the solve was cancelled.
+internal bool
+monitor_update(WfcMonitor *monitor, const Wave *wave)
+{
+    if (atomic_load_explicit(&monitor->cancelled, memory_order_relaxed))
+        return false;
+    const uint64_t now = now_ns();
+    if (now < atomic_load_explicit(&monitor->next_publish, memory_order_relaxed) ||
+        atomic_flag_test_and_set_explicit(&monitor->publishing, memory_order_acquire))
+        return true;
+
+    if (now >= atomic_load_explicit(&monitor->next_publish, memory_order_relaxed)) {
+        const size_t output_width = monitor->output_width;
+        uint32_t *pixels = monitor->buffers + (size_t)monitor->back * output_width * monitor->output_height;
+        for (size_t y = 0; y < monitor->output_height; ++y)
+            for (size_t x = 0; x < output_width; ++x)
+                pixels[y * output_width + x] = wave_preview_pixel(wave, x, y);
+
+        unsigned int middle = atomic_exchange(&monitor->middle, monitor->back | MONITOR_FRESH);
+        monitor->back = middle & ~MONITOR_FRESH;
+        atomic_store_explicit(&monitor->next_publish, now + monitor->interval_ns, memory_order_relaxed);
+    }
+    atomic_flag_clear_explicit(&monitor->publishing, memory_order_release);
+    return true;
+}
+
+
+// Run one attempt from a freshly initialised wave
+internal WfcStatus
+wave_run(Wave *wave, const WfcOptions *options, const uint64_t deadline)
+{
+    unsigned int backtracks = 0;
+    uint64_t start = wave->timed ? now_ns() : 0;
+
+    while (1) {
+        bool propagated = wave_propagate(wave);
+        if (!propagated) {
+            wave->counters.n_contradictions++;
+            propagated = options->recovery == WFC_RECOVER_BACKTRACK &&
+                         wave_backtrack(wave, options->max_backtracks, &backtracks);
+        }
+        if (wave->timed) {
+            uint64_t now = now_ns();
+            wave->counters.propagate_ns += now - start;
+            start = now;
+        }
+        if (!propagated)
+            return WFC_CONTRADICTION;
+        if (deadline && now_ns() >= deadline)
+            return WFC_TIMEOUT;
+        if (wave->best_attempt && atomic_load_explicit(wave->best_attempt, memory_order_relaxed) < wave->attempt)
+            return WFC_CANCELLED;
+        if (wave->monitor && !monitor_update(wave->monitor, wave))
+            return WFC_CANCELLED;
+        if (wave->timed)
+            start = now_ns();
+        if (!wave_observe(wave))
+            return WFC_OK;
+        if (wave->timed) {
+            uint64_t now = now_ns();
+            wave->counters.observe_ns += now - start;
+            start = now;
+        }
+    }
+}
+
+
+#define WORKSPACE_ALIGN 64
+
+internal void pool_layout(Wave *wave, const WfcOptions *options, char *base, size_t *used);
+
+// Hand out the next aligned block of a workspace. With a NULL base only the
+// running size advances, which is how footprints are measured.
+internal void *
+workspace_take(char *base, size_t *used, const size_t bytes)
+{
+    size_t offset = (*used + WORKSPACE_ALIGN - 1) / WORKSPACE_ALIGN * WORKSPACE_ALIGN;
+    *used = offset + bytes;
+    return base ? base + offset : NULL;
+}
+
+
+// Lay a wave's arrays out from base onwards, or just measure them when base
+// is NULL. Everything is sized for the worst case, so a wave never allocates
+// once it has been laid out.
+internal void
+wave_layout(Wave *wave, const WfcModel *model, const size_t width, const size_t height,
+            const WfcOptions *options, char *base, size_t *used)
+{
+    size_t size = width * height;
+    size_t n_patterns = model->n_patterns;
+    size_t n_words = model->n_words;
+
+    *wave = (Wave){
+        .width = width,
+        .height = height,
+        .size = size,
+        .n_patterns = n_patterns,
+        .n_words = n_words,
+        .propagator = options->propagator,
+        .periodic = options->periodic_output,
+        .rules = &model->rules,
+        .rule_masks = model->rule_masks,
+        .model = model,
+        .monitor = options->monitor,
+        .timed = options->stats != NULL,
+        .cells = workspace_take(base, used, size * n_words * sizeof(uint64_t)),
+        .counts = workspace_take(base, used, size * sizeof(size_t)),
+        .pattern_nos = workspace_take(base, used, size * sizeof(size_t)),
+        .changed = workspace_take(base, used, size * sizeof(bool)),
+        .stack = workspace_take(base, used, size * sizeof(size_t)),
+        .scratch = workspace_take(base, used, 2 * n_words * sizeof(uint64_t)),
+        .weights = model->weights,
+        .weight_log_weights = model->weight_log_weights,
+        .sum_weights = workspace_take(base, used, size * sizeof(uint64_t)),
+        .sum_weight_log_weights = workspace_take(base, used, size * sizeof(int64_t)),
+        .noise = workspace_take(base, used, size * sizeof(double)),
+        .entropies = workspace_take(base, used, size * sizeof(double)),
+        .heap = workspace_take(base, used, size * sizeof(size_t)),
+        .heap_pos = workspace_take(base, used, size * sizeof(size_t)),
+    };
+
+    if (wave->propagator == WFC_PROPAGATE_AC4) {
+        wave->supports = workspace_take(base, used, size * n_patterns * N_DIRECTIONS * sizeof(uint32_t));
+        wave->bans = workspace_take(base, used, size * n_patterns * sizeof(Ban));
+    }
+    if (options->recovery == WFC_RECOVER_BACKTRACK) {
+        wave->trail = workspace_take(base, used, size * n_patterns * sizeof(Ban));
+        wave->decisions = workspace_take(base, used, size * sizeof(Decision));
+    }
+    if (wave->propagator == WFC_PROPAGATE_PARALLEL) {
+        wave->parallel_threshold = options->parallel_threshold ? options->parallel_threshold
+                                                               : PARALLEL_PROPAGATION_THRESHOLD;
+        pool_layout(wave, options, base, used);
+    }
+}
+
+
+// Split the wave into bands of whole rows with the queues between them
+internal void
+pool_layout(Wave *wave, const WfcOptions *options, char *base, size_t *used)
+{
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n_regions = options->n_propagation_threads ? options->n_propagation_threads : (n_cpus > 0 ? n_cpus : 1);
+    if (n_regions > MAX_PROPAGATION_THREADS)
+        n_regions = MAX_PROPAGATION_THREADS;
+    if (n_regions > wave->height)
+        n_regions = wave->height;
+    // Bands only trade support with the bands above and below them, so a
+    // periodic wave, whose top and bottom rows meet, propagates serially
+    if (n_regions < 2 || wave->periodic)
+        return;
+
+    const size_t n_words = wave->n_words;
+    size_t queue_capacity = 64;
+    while (queue_capacity < 4 * wave->width)
+        queue_capacity *= 2;
+
+    PropagationPool *pool = workspace_take(base, used, sizeof(PropagationPool));
+    Region *regions = workspace_take(base, used, n_regions * sizeof(Region));
+    unsigned int *row_region = workspace_take(base, used, wave->height * sizeof(unsigned int));
+    pthread_t *threads = workspace_take(base, used, (n_regions - 1) * sizeof(pthread_t));
+    uint64_t *snapshot = workspace_take(base, used, wave->size * n_words * sizeof(uint64_t));
+    bool *touched = workspace_take(base, used, wave->size * sizeof(bool));
+    size_t *stacks = workspace_take(base, used, wave->size * sizeof(size_t));
+    size_t *touched_lists = workspace_take(base, used, wave->size * sizeof(size_t));
+    uint64_t *scratch = workspace_take(base, used, n_regions * 2 * n_words * sizeof(uint64_t));
+    SupportQueue *queues = workspace_take(base, used, 2 * (n_regions - 1) * sizeof(SupportQueue));
+    uint64_t *slots = workspace_take(base, used, 2 * (n_regions - 1) * queue_capacity * (1 + n_words) * sizeof(uint64_t));
+    if (base == NULL)
+        return;
+
+    *pool = (PropagationPool){
+        .n_regions = n_regions,
+        .regions = regions,
+        .row_region = row_region,
+        .threads = threads,
+        .snapshot = snapshot,
+        .touched = touched,
+    };
+    memset(touched, 0, wave->size * sizeof(bool));
+
+    // Queue 2i carries supports down from band i, queue 2i + 1 up from band i + 1
+    for (size_t q = 0; q < 2 * (n_regions - 1); ++q) {
+        queues[q].slots = slots + q * queue_capacity * (1 + n_words);
+        queues[q].capacity = queue_capacity;
+        atomic_init(&queues[q].head, 0);
+        atomic_init(&queues[q].tail, 0);
+    }
+
+    for (size_t i = 0; i < n_regions; ++i) {
+        size_t first_row = i * wave->height / n_regions;
+        size_t end_row = (i + 1) * wave->height / n_regions;
+        for (size_t row = first_row; row < end_row; ++row)
+            row_region[row] = i;
+
+        regions[i] = (Region){
+            .wave = wave,
+            .stack = stacks + first_row * wave->width,
+            .touched = touched_lists + first_row * wave->width,
+            .scratch = scratch + i * 2 * n_words,
+            .to_up = i > 0 ? &queues[2 * (i - 1) + 1] : NULL,
+            .from_up = i > 0 ? &queues[2 * (i - 1)] : NULL,
+            .to_down = i + 1 < n_regions ? &queues[2 * i] : NULL,
+            .from_down = i + 1 < n_regions ? &queues[2 * i + 1] : NULL,
+        };
+    }
+    wave->pool = pool;
+}
+
+
+// All the solver state for one job: a wave per thread and the winning
+// placement, carved out of a single allocation
+struct WfcWorkspace
+{
+    char *memory;
+    size_t capacity;                // bytes in memory
+
+    const WfcModel *model;
+    WfcOptions options;
+    unsigned int output_width, output_height;
+    size_t width, height;           // output grid, in pattern positions
+    unsigned int n_waves;
+    Wave *waves;
+    size_t *solution;
+    // With constraints: the patterns each cell may hold, shared by every
+    // wave, and for sampled models a set per pattern cell and palette
+    // colour of the patterns with that colour there
+    uint64_t *allowed;              // width * height * n_words
+    uint64_t *colour_masks;         // N^2 * n_colours * n_words
+};
+
+
+internal unsigned int
+workspace_max_attempts(const WfcOptions *options)
+{
+    if (options->recovery == WFC_RECOVER_NONE)
+        return 1;
+    return options->max_attempts ? options->max_attempts : WFC_DEFAULT_MAX_ATTEMPTS;
+}
+
+
+// Lay a whole workspace out from base, or measure it when base is NULL.
+// Returns the bytes needed, or 0 for a job that cannot be run.
+internal size_t
+workspace_layout(WfcWorkspace *workspace, const WfcModel *model, const unsigned int output_width,
+                 const unsigned int output_height, const WfcOptions *options, char *base)
+{
+    const unsigned int pattern_size = model->pattern_size;
+    const unsigned int tile_size = model->tile_size ? model->tile_size : 1;
+    if (output_width < pattern_size * tile_size || output_height < pattern_size * tile_size ||
+        output_width % tile_size || output_height % tile_size)
+        return 0;
+
+    // A periodic output has a pattern at every pixel, the ones at the right
+    // and bottom edges overlapping the left and top of the output. Tiled
+    // models have single-cell patterns and one per tile either way.
+    size_t width = output_width / tile_size;
+    size_t height = output_height / tile_size;
+    if (!options->periodic_output) {
+        width -= pattern_size - 1;
+        height -= pattern_size - 1;
+    }
+    // Bans and trail entries store cells and patterns in 32 bits
+    if ((uint64_t)width * height > UINT32_MAX)
+        return 0;
+    if (options->monitor && (options->monitor->output_width != output_width ||
+                             options->monitor->output_height != output_height))
+        return 0;
+
+    unsigned int n_waves = options->n_threads ? options->n_threads : 1;
+    if (n_waves > workspace_max_attempts(options))
+        n_waves = workspace_max_attempts(options);
+
+    size_t used = 0;
+    Wave *waves = workspace_take(base, &used, n_waves * sizeof(Wave));
+    size_t *solution = workspace_take(base, &used, width * height * sizeof(size_t));
+    uint64_t *allowed = NULL, *colour_masks = NULL;
+    if (options->constraints) {
+        allowed = workspace_take(base, &used, width * height * model->n_words * sizeof(uint64_t));
+        if (!model->tile_size)
+            colour_masks = workspace_take(base, &used, (size_t)pattern_size * pattern_size * model->n_colours *
+                                                       model->n_words * sizeof(uint64_t));
+    }
+    for (unsigned int i = 0; i < n_waves; ++i) {
+        // Laid out in place, since band regions point back at their wave
+        Wave measured;
+        wave_layout(base ? &waves[i] : &measured, model, width, height, options, base, &used);
+        if (base)
+            waves[i].allowed = allowed;
+    }
+
+    if (base) {
+        workspace->model = model;
+        workspace->options = *options;
+        workspace->output_width = output_width;
+        workspace->output_height = output_height;
+        workspace->width = width;
+        workspace->height = height;
+        workspace->n_waves = n_waves;
+        workspace->waves = waves;
+        workspace->solution = solution;
+        workspace->allowed = allowed;
+        workspace->colour_masks = colour_masks;
+    }
+    return used;
+}
+
+
+size_t wfc_workspace_footprint(const WfcModel *model, const unsigned int output_width,
+                               const unsigned int output_height, const WfcOptions *options)
+{
+    return workspace_layout(NULL, model, output_width, output_height, options, NULL);
+}
+
+
+WfcStatus wfc_workspace_create(const WfcModel *model, const unsigned int output_width,
+                               const unsigned int output_height, const WfcOptions *options,
+                               WfcWorkspace **result)
+{
+    size_t footprint = wfc_workspace_footprint(model, output_width, output_height, options);
+    if (footprint == 0)
+        return WFC_BAD_INPUT;
+
+    WfcWorkspace *workspace = malloc(sizeof(WfcWorkspace));
+    if (workspace == NULL)
+        return WFC_OUT_OF_MEMORY;
+
+    workspace->capacity = (footprint + WORKSPACE_ALIGN - 1) / WORKSPACE_ALIGN * WORKSPACE_ALIGN;
+    workspace->memory = aligned_alloc(WORKSPACE_ALIGN, workspace->capacity);
+    if (workspace->memory == NULL) {
+        if (!options->quiet)
+            logger(WARNING, "Could not allocate a %zu byte WFC workspace", workspace->capacity);
+        free(workspace);
+        return WFC_OUT_OF_MEMORY;
+    }
+
+    workspace_layout(workspace, model, output_width, output_height, options, workspace->memory);
+    *result = workspace;
+    return WFC_OK;
+}
+
+
+WfcStatus wfc_workspace_reset(WfcWorkspace *workspace, const WfcModel *model, const unsigned int output_width,
+                              const unsigned int output_height, const WfcOptions *options)
+{
+    size_t footprint = wfc_workspace_footprint(model, output_width, output_height, options);
+    if (footprint == 0)
+        return WFC_BAD_INPUT;
+    if (footprint > workspace->capacity)
+        return WFC_OUT_OF_MEMORY;
+
+    workspace_layout(workspace, model, output_width, output_height, options, workspace->memory);
+    return WFC_OK;
+}
+
+
+void wfc_workspace_free(WfcWorkspace *workspace)
+{
+    if (workspace == NULL)
+        return;
+    free(workspace->memory);
+    free(workspace);
+}
+
+
+// Attempts are numbered from zero and the lowest-numbered success wins, so
+// the output depends only on the seed, never on the number of threads or
+// on which thread finishes first. Once attempt i succeeds, attempts after
+// it are abandoned while earlier ones are left to finish.
+typedef struct SolveShared
+{
+    const WfcOptions *options;
+    uint64_t seed, deadline;
+    unsigned int max_attempts;
+
+    atomic_uint next_attempt;
+    atomic_uint best_attempt;       // UINT_MAX until an attempt succeeds
+    atomic_bool timed_out;
+
+    pthread_mutex_t lock;
+    size_t *solution;               // pattern_nos of the best attempt so far
+} SolveShared;
+
+
+typedef struct SolveWorker
+{
+    SolveShared *shared;
+    Wave *wave;
+} SolveWorker;
+
+
+internal void *
+solve_worker(void *arg)
+{
+    SolveShared *shared = ((SolveWorker *)arg)->shared;
+    Wave *wave = ((SolveWorker *)arg)->wave;
+    wave->best_attempt = &shared->best_attempt;
+
+    PropagationPool *pool = wave->pool;
+    if (pool && !pool_start(wave)) {
+        if (!shared->options->quiet)
+            logger(WARNING, "Could not start propagation threads, propagating serially");
+        wave->pool = NULL;
+    }
+
+    while (1) {
+        unsigned int attempt = atomic_fetch_add(&shared->next_attempt, 1);
+        if (attempt >= shared->max_attempts || attempt > atomic_load(&shared->best_attempt))
+            break;
+        if (wave->monitor && atomic_load(&wave->monitor->cancelled))
+            break;
+
+        wave->attempt = attempt;
+        wave->counters.n_attempts++;
+        wave->rng = rng_stream(shared->seed, attempt);
+        wave_init(wave);
+
+        WfcStatus status = wave_run(wave, shared->options, shared->deadline);
+        if (status == WFC_OK) {
+            pthread_mutex_lock(&shared->lock);
+            if (attempt < atomic_load(&shared->best_attempt)) {
+                memcpy(shared->solution, wave->pattern_nos, wave->size * sizeof(size_t));
+                atomic_store(&shared->best_attempt, attempt);
+            }
+            pthread_mutex_unlock(&shared->lock);
+        } else if (status == WFC_TIMEOUT) {
+            atomic_store(&shared->timed_out, true);
+            break;
+        } else if (status == WFC_CONTRADICTION && !shared->options->quiet) {
+            logger(DEBUG, "WFC attempt %u reached a contradiction", attempt + 1);
+        }
+    }
+
+    if (wave->pool)
+        pool_stop(wave);
+    wave->pool = pool;
+    return NULL;
+}
+
+
+// Hold the output pixel (x, y) to colour: every placement whose pattern
+// covers it keeps only the patterns with that colour in the right place
+internal void
+workspace_constrain_pixel(WfcWorkspace *workspace, const size_t x, const size_t y, const uint32_t colour)
+{
+    const WfcModel *model = workspace->model;
+    const size_t n_words = model->n_words;
+
+    if (model->tile_size) {
+        const size_t tile_size = model->tile_size;
+        const size_t offset = (y % tile_size) * tile_size + x % tile_size;
+        uint64_t *set = workspace->allowed + ((y / tile_size) * workspace->width + x / tile_size) * n_words;
+        for (size_t p = 0; p < model->n_patterns; ++p)
+            if (model->tiles[p * tile_size * tile_size + offset] != colour)
+                bitset_clear(set, p);
+        return;
+    }
+
+    // A colour the sample never uses rules out every covering placement
+    size_t index = 0;
+    while (index < model->n_colours && model->palette[index] != colour)
+        index++;
+
+    const size_t n = model->pattern_size;
+    const bool periodic = workspace->options.periodic_output;
+    for (size_t dy = 0; dy < n; ++dy) {
+        for (size_t dx = 0; dx < n; ++dx) {
+            size_t u = x - dx, v = y - dy;
+            if (periodic) {
+                u = (x + workspace->width - dx) % workspace->width;
+                v = (y + workspace->height - dy) % workspace->height;
+            } else if (x < dx || y < dy || u >= workspace->width || v >= workspace->height) {
+                continue;
+            }
+
+            uint64_t *set = workspace->allowed + (v * workspace->width + u) * n_words;
+            if (index == model->n_colours) {
+                memset(set, 0, n_words * sizeof(uint64_t));
+                continue;
+            }
+            const uint64_t *mask = workspace->colour_masks + ((dy * n + dx) * model->n_colours + index) * n_words;
+            for (size_t w = 0; w < n_words; ++w)
+                set[w] &= mask[w];
+        }
+    }
+}
+
+
+// Work out the patterns each cell may hold under the job's constraints,
+// once per job rather than per attempt. Returns false if some cell is left
+// with none, which no attempt could get past.
+internal bool
+workspace_constrain(WfcWorkspace *workspace)
+{
+    const WfcConstraints *constraints = workspace->options.constraints;
+    const WfcModel *model = workspace->model;
+    const size_t n_words = model->n_words;
+    const size_t size = workspace->width * workspace->height;
+
+    for (size_t i = 0; i < size; ++i)
+        bitset_fill(workspace->allowed + i * n_words, model->n_patterns);
+
+    if (constraints->pattern_mask && constraints->patterns) {
+        for (size_t i = 0; i < size; ++i) {
+            if (!constraints->pattern_mask[i])
+                continue;
+            uint64_t *set = workspace->allowed + i * n_words;
+            const uint64_t *patterns = constraints->patterns + i * n_words;
+            for (size_t w = 0; w < n_words; ++w)
+                set[w] &= patterns[w];
+        }
+    }
+
+    if (constraints->colour_mask && constraints->colours) {
+        if (workspace->colour_masks) {
+            const size_t n_values = (size_t)model->pattern_size * model->pattern_size;
+            memset(workspace->colour_masks, 0, n_values * model->n_colours * n_words * sizeof(uint64_t));
+            for (size_t p = 0; p < model->n_patterns; ++p)
+                for (size_t k = 0; k < n_values; ++k)
+                    bitset_set(workspace->colour_masks + (k * model->n_colours + model->values[p * n_values + k]) * n_words, p);
+        }
+
+        const size_t output_width = workspace->output_width;
+        for (size_t y = 0; y < workspace->output_height; ++y)
+            for (size_t x = 0; x < output_width; ++x)
+                if (constraints->colour_mask[y * output_width + x])
+                    workspace_constrain_pixel(workspace, x, y, constraints->colours[y * output_width + x]);
+    }
+
+    for (size_t i = 0; i < size; ++i) {
+        if (bitset_count(workspace->allowed + i * n_words, n_words) == 0) {
+            if (!workspace->options.quiet)
+                logger(DEBUG, "WFC constraints leave placement (%zu, %zu) with no patterns",
+                       i % workspace->width, i / workspace->width);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Add what a job's waves counted to stats
+internal void
+workspace_add_stats(const WfcWorkspace *workspace, const uint64_t solve_ns, WfcStats *stats)
+{
+    const WfcModel *model = workspace->model;
+    stats->n_patterns = model->n_patterns;
+    stats->n_rules = model->rules.offsets[model->n_patterns * N_DIRECTIONS];
+    stats->solve_ms += solve_ns / 1e6;
+    if (workspace->capacity > stats->peak_workspace_bytes)
+        stats->peak_workspace_bytes = workspace->capacity;
+
+    for (unsigned int i = 0; i < workspace->n_waves; ++i) {
+        const SolveCounters *counters = &workspace->waves[i].counters;
+        stats->n_attempts += counters->n_attempts;
+        stats->n_observations += counters->n_observations;
+        stats->n_propagations += counters->n_propagations;
+        stats->n_cells_visited += counters->n_cells_visited;
+        stats->n_bans += counters->n_bans;
+        stats->n_contradictions += counters->n_contradictions;
+        stats->n_parallel_passes += counters->n_parallel_passes;
+        stats->propagate_ms += counters->propagate_ns / 1e6;
+        stats->observe_ms += counters->observe_ns / 1e6;
+    }
+}
+
+
+// Run attempts until one succeeds, spread over one thread per wave in the
+// workspace (the calling thread alone when there is a single wave), and
+// store the winning pattern placement in the workspace's solution
+internal WfcStatus
+workspace_solve(WfcWorkspace *workspace)
+{
+    const WfcOptions *options = &workspace->options;
+    if (workspace->allowed && !workspace_constrain(workspace))
+        return WFC_CONTRADICTION;
+
+    SolveShared shared = {
+        .options = options,
+        .seed = options->seed ? options->seed : (uint64_t)time(NULL),
+        .deadline = options->time_limit_ms ? now_ns() + (uint64_t)options->time_limit_ms * 1000000 : 0,
+        .max_attempts = workspace_max_attempts(options),
+        .solution = workspace->solution,
+    };
+    atomic_init(&shared.next_attempt, 0);
+    atomic_init(&shared.best_attempt, UINT_MAX);
+    atomic_init(&shared.timed_out, false);
+    pthread_mutex_init(&shared.lock, NULL);
+
+    const unsigned int n_threads = workspace->n_waves;
+    for (unsigned int i = 0; i < n_threads; ++i)
+        workspace->waves[i].counters = (SolveCounters){0};
+    const uint64_t start = now_ns();
+
+    pthread_t threads[n_threads];
+    SolveWorker workers[n_threads];
+    unsigned int n_started = 0;
+    for (unsigned int i = 0; i < n_threads; ++i)
+        workers[i] = (SolveWorker){.shared = &shared, .wave = &workspace->waves[i]};
+    for (unsigned int i = 1; i < n_threads; ++i) {
+        if (pthread_create(&threads[n_started], NULL, solve_worker, &workers[i]) != 0)
+            break;
+        n_started++;
+    }
+    solve_worker(&workers[0]);
+    for (unsigned int i = 0; i < n_started; ++i)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&shared.lock);
+
+    if (options->stats)
+        workspace_add_stats(workspace, now_ns() - start, options->stats);
+
+    if (atomic_load(&shared.best_attempt) != UINT_MAX)
+        return WFC_OK;
+    if (atomic_load(&shared.timed_out))
+        return WFC_TIMEOUT;
+    if (options->monitor && atomic_load(&options->monitor->cancelled))
+        return WFC_CANCELLED;
+    return WFC_CONTRADICTION;
+}
+
+
+const char *wfc_status_string(const WfcStatus status)
+{
+    switch (status) {
+        case WFC_OK:            return "ok";
+        case WFC_CONTRADICTION: return "contradiction";
+        case WFC_TIMEOUT:       return "timeout";
+        case WFC_BAD_INPUT:     return "bad input";
+        case WFC_OUT_OF_MEMORY: return "out of memory";
+        case WFC_CANCELLED:     return "cancelled";
+        case WFC_IO_ERROR:      return "i/o error";
+        case WFC_BAD_MODEL:     return "bad model file";
+        default:                return "unknown";
+    }
+}
+
+
+uint32_t *run_wfc_algo(const CellGrid *grid, const unsigned int pattern_size, const unsigned int output_width, const unsigned int output_height)
+{
+    WfcOptions options = {
+        .propagator = WFC_PROPAGATE_BITSET,
+        .recovery = WFC_RECOVER_BACKTRACK,
+    };
+    return run_wfc_algo_opts(grid, pattern_size, output_width, output_height, &options);
+}
+
+
+uint32_t *run_wfc_algo_opts(const CellGrid *grid, const unsigned int pattern_size, 
+                            const unsigned int output_width, const unsigned int output_height,
+                            const WfcOptions *options)
+{
+    uint32_t *result = malloc(output_width * output_height * sizeof result[0]);
+    if (result == NULL)
+        return NULL;
+
+    WfcStatus status = wfc_generate(grid, pattern_size, output_width, output_height, options, result);
+    if (status != WFC_OK) {
+        if (!options->quiet)
+            logger(WARNING, "WFC generation failed: %s", wfc_status_string(status));
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+
+// Compiled model files are the arrays of a WfcModel laid out back to back
+// after this header, in the host's byte order. Every section starts on a
+// WFC_MODEL_ALIGN boundary so the file can be used in place once mapped.
+#define WFC_MODEL_MAGIC "PICTWFC"
+#define WFC_MODEL_VERSION 3
+#define WFC_MODEL_ALIGN 64
+
+typedef struct ModelFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t pattern_size, tile_size;
+    uint64_t n_patterns, n_colours, n_allowed, file_size;
+    // Byte offsets of each section from the start of the file
+    uint64_t palette, values, tiles, weights, weight_log_weights;
+    uint64_t rule_offsets, rule_patterns, rule_masks;
+} ModelFileHeader;
+
+
+internal uint64_t
+model_file_section(uint64_t *end, const uint64_t size)
+{
+    uint64_t offset = (*end + WFC_MODEL_ALIGN - 1) / WFC_MODEL_ALIGN * WFC_MODEL_ALIGN;
+    *end = offset + size;
+    return offset;
+}
+
+
+// Work out the section offsets and file size from the counts in the header
+internal void
+model_file_layout(ModelFileHeader *header)
+{
+    uint64_t n_rules = header->n_patterns * N_DIRECTIONS;
+    uint64_t n_words = bitset_words(header->n_patterns);
+    uint64_t end = sizeof(ModelFileHeader);
+
+    header->palette = model_file_section(&end, header->n_colours * sizeof(uint32_t));
+    header->values = model_file_section(&end, header->tile_size ? 0 : header->n_patterns * header->pattern_size * header->pattern_size);
+    header->tiles = model_file_section(&end, header->n_patterns * header->tile_size * header->tile_size * sizeof(uint32_t));
+    header->weights = model_file_section(&end, header->n_patterns * sizeof(uint32_t));
+    header->weight_log_weights = model_file_section(&end, header->n_patterns * sizeof(int64_t));
+    header->rule_offsets = model_file_section(&end, (n_rules + 1) * sizeof(uint32_t));
+    header->rule_patterns = model_file_section(&end, header->n_allowed * sizeof(uint32_t));
+    header->rule_masks = model_file_section(&end, n_rules * n_words * sizeof(uint64_t));
+    header->file_size = end;
+}
+
+
+internal bool
+model_file_write(FILE *file, uint64_t *position, const uint64_t offset, const void *data, const size_t size)
+{
+    static const char padding[WFC_MODEL_ALIGN];
+    if (fwrite(padding, 1, offset - *position, file) != offset - *position)
+        return false;
+    if (size && fwrite(data, 1, size, file) != size)
+        return false;
+    *position = offset + size;
+    return true;
+}
+
+
+// Map colours to palette indices, in order of first appearance. Indices are
+// stored in a byte, so a sample may use at most 256 colours.
+internal WfcStatus
+model_build_palette(WfcModel *model, const CellGrid *grid, IndexedGrid *indexed)
+{
+    size_t capacity = 16;
+    uint32_t *palette = malloc(capacity * sizeof(uint32_t));
+    ValueTable table = {.capacity = 2 * capacity};
+    table.slots = calloc(table.capacity, sizeof(size_t));
+    size_t n_colours = 0;
+    WfcStatus status = WFC_OUT_OF_MEMORY;
+
+    if (palette == NULL || table.slots == NULL)
+        goto fail;
+
+    for (size_t i = 0; i < (size_t)grid->rows * grid->cols; ++i) {
+        size_t slot = value_table_find(&table, palette, &grid->cells[i], sizeof(uint32_t));
+        if (!table.slots[slot]) {
+            if (n_colours == UINT8_MAX + 1) {
+                logger(ERROR, "Sample has more than %d colours", UINT8_MAX + 1);
+                status = WFC_BAD_INPUT;
+                goto fail;
+            }
+            if (n_colours == capacity) {
+                uint32_t *grown = realloc(palette, 2 * capacity * sizeof(uint32_t));
+                if (grown == NULL)
+                    goto fail;
+                palette = grown;
+                capacity *= 2;
+            }
+            palette[n_colours] = grid->cells[i];
+            table.slots[slot] = ++n_colours;
+            if (2 * n_colours > table.capacity && !value_table_grow(&table, palette, n_colours, sizeof(uint32_t)))
+                goto fail;
+        }
+        indexed->cells[i] = table.slots[slot] - 1;
+    }
+
+    indexed->index_bits = 1;
+    while (((size_t)1 << indexed->index_bits) < n_colours)
+        indexed->index_bits++;
+
+    free(table.slots);
+    model->palette = palette;
+    model->n_colours = n_colours;
+    return WFC_OK;
+
+fail:
+    free(palette);
+    free(table.slots);
+    return status;
+}
+
+
+WfcStatus wfc_model_compile(const CellGrid *grid, const unsigned int pattern_size, WfcModel **result)
+{
+    WfcOptions options = {0};
+    return wfc_model_compile_opts(grid, pattern_size, &options, result);
+}
+
+
+WfcStatus wfc_model_compile_opts(const CellGrid *grid, const unsigned int pattern_size,
+                                 const WfcOptions *options, WfcModel **result)
+{
+    const unsigned int symmetry = options->symmetry ? options->symmetry : WFC_DEFAULT_SYMMETRY;
+    if (pattern_size == 0 || grid->rows < pattern_size || grid->cols < pattern_size)
+        return WFC_BAD_INPUT;
+    if (symmetry != 1 && symmetry != 2 && symmetry != 4 && symmetry != 8)
+        return WFC_BAD_INPUT;
+
+    WfcModel *model = calloc(1, sizeof(WfcModel));
+    IndexedGrid indexed = {
+        .cells = malloc((size_t)grid->rows * grid->cols),
+        .rows = grid->rows,
+        .cols = grid->cols,
+    };
+    Pattern *patterns = NULL;
+    WfcStatus status = WFC_OUT_OF_MEMORY;
+    uint64_t start = now_ns();
+
+    if (model == NULL || indexed.cells == NULL ||
+        (status = model_build_palette(model, grid, &indexed)) != WFC_OK)
+        goto fail;
+    status = WFC_OUT_OF_MEMORY;
+
+    int pattern_count = generate_patterns(&indexed, pattern_size, symmetry, options->periodic_input, &patterns);
+    free(indexed.cells);
+    indexed.cells = NULL;
+    if (pattern_count < 0)
+        goto fail;
+
+    model->pattern_size = pattern_size;
+    model->n_patterns = pattern_count;
+    model->n_words = bitset_words(model->n_patterns);
+    model->values = patterns[0].values;
+    if (options->stats) {
+        options->stats->n_patterns = model->n_patterns;
+        options->stats->extract_ms = (now_ns() - start) / 1e6;
+        start = now_ns();
+    }
+
+    size_t n_rules = model->n_patterns * N_DIRECTIONS;
+    uint64_t *rule_masks = malloc(n_rules * model->n_words * sizeof(uint64_t));
+    uint32_t *weights = malloc(model->n_patterns * sizeof(uint32_t));
+    int64_t *weight_log_weights = malloc(model->n_patterns * sizeof(int64_t));
+    model->rule_masks = rule_masks;
+    model->weights = weights;
+    model->weight_log_weights = weight_log_weights;
+
+    if (!rule_masks || !weights || !weight_log_weights ||
+        !establish_rules(model->n_patterns, patterns, pattern_size, indexed.index_bits, &model->rules))
+        goto fail;
+
+    build_rule_masks(n_rules, &model->rules, model->n_words, rule_masks);
+    build_weights(model->n_patterns, patterns, weights, weight_log_weights);
+    if (options->stats) {
+        options->stats->n_rules = model->rules.offsets[n_rules];
+        options->stats->rules_ms = (now_ns() - start) / 1e6;
+    }
+
+    // The values arena now belongs to the model
+    free(patterns);
+    *result = model;
+    return WFC_OK;
+
+fail:
+    free(indexed.cells);
+    free(patterns);
+    wfc_model_free(model);
+    return status;
+}
+
+
+WfcStatus wfc_tiled_model_compile(const WfcTileset *tileset, WfcModel **result)
+{
+    const size_t n_tiles = tileset->n_tiles;
+    const size_t tile_area = (size_t)tileset->tile_size * tileset->tile_size;
+    if (n_tiles == 0 || n_tiles > UINT32_MAX || tileset->tile_size == 0 || tileset->pixels == NULL)
+        return WFC_BAD_INPUT;
+    for (size_t i = 0; i < tileset->n_neighbours; ++i) {
+        const WfcTileNeighbour *pair = &tileset->neighbours[i];
+        if (pair->first >= n_tiles || pair->second >= n_tiles)
+            return WFC_BAD_INPUT;
+    }
+    for (size_t i = 0; tileset->weights && i < n_tiles; ++i)
+        if (tileset->weights[i] == 0)
+            return WFC_BAD_INPUT;
+
+    WfcModel *model = calloc(1, sizeof(WfcModel));
+    if (model == NULL)
+        return WFC_OUT_OF_MEMORY;
+
+    model->pattern_size = 1;
+    model->tile_size = tileset->tile_size;
+    model->n_patterns = n_tiles;
+    model->n_words = bitset_words(n_tiles);
+
+    size_t n_rules = n_tiles * N_DIRECTIONS;
+    uint32_t *tiles = malloc(n_tiles * tile_area * sizeof(uint32_t));
+    uint64_t *rule_masks = calloc(n_rules * model->n_words, sizeof(uint64_t));
+    uint32_t *weights = malloc(n_tiles * sizeof(uint32_t));
+    int64_t *weight_log_weights = malloc(n_tiles * sizeof(int64_t));
+    model->tiles = tiles;
+    model->rule_masks = rule_masks;
+    model->weights = weights;
+    model->weight_log_weights = weight_log_weights;
+    if (!tiles || !rule_masks || !weights || !weight_log_weights)
+        goto fail;
+
+    memcpy(tiles, tileset->pixels, n_tiles * tile_area * sizeof(uint32_t));
+    for (size_t i = 0; i < n_tiles; ++i) {
+        weights[i] = tileset->weights ? tileset->weights[i] : 1;
+        weight_log_weights[i] = weight_log_weight(weights[i]);
+    }
+
+    // Each pair allows the second tile right of (or below) the first, and
+    // the first left of (or above) the second
+    for (size_t i = 0; i < tileset->n_neighbours; ++i) {
+        const WfcTileNeighbour *pair = &tileset->neighbours[i];
+        int d = pair->vertical ? 3 : 2;
+        bitset_set(rule_masks + (pair->first * N_DIRECTIONS + d) * model->n_words, pair->second);
+        bitset_set(rule_masks + (pair->second * N_DIRECTIONS + N_DIRECTIONS - 1 - d) * model->n_words, pair->first);
+    }
+    if (!rules_from_masks(n_rules, rule_masks, model->n_words, &model->rules))
+        goto fail;
+
+    *result = model;
+    return WFC_OK;
+
+fail:
+    wfc_model_free(model);
+    return WFC_OUT_OF_MEMORY;
+}
+
+
+WfcStatus wfc_model_save(const WfcModel *model, const char *path)
+{
+    ModelFileHeader header = {
+        .magic = WFC_MODEL_MAGIC,
+        .version = WFC_MODEL_VERSION,
+        .pattern_size = model->pattern_size,
+        .tile_size = model->tile_size,
+        .n_patterns = model->n_patterns,
+        .n_colours = model->n_colours,
+        .n_allowed = model->rules.offsets[model->n_patterns * N_DIRECTIONS],
+    };
+    model_file_layout(&header);
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        logger(ERROR, "Could not open %s for writing", path);
+        return WFC_IO_ERROR;
+    }
+
+    size_t n_rules = model->n_patterns * N_DIRECTIONS;
+    size_t pattern_area = model->tile_size ? 0 : model->pattern_size * model->pattern_size;
+    size_t tile_area = model->tile_size * model->tile_size;
+    uint64_t position = 0;
+    bool ok = model_file_write(file, &position, 0, &header, sizeof header) &&
+              model_file_write(file, &position, header.palette, model->palette, model->n_colours * sizeof(uint32_t)) &&
+              model_file_write(file, &position, header.values, model->values, model->n_patterns * pattern_area) &&
+              model_file_write(file, &position, header.tiles, model->tiles, model->n_patterns * tile_area * sizeof(uint32_t)) &&
+              model_file_write(file, &position, header.weights, model->weights, model->n_patterns * sizeof(uint32_t)) &&
+              model_file_write(file, &position, header.weight_log_weights, model->weight_log_weights, model->n_patterns * sizeof(int64_t)) &&
+              model_file_write(file, &position, header.rule_offsets, model->rules.offsets, (n_rules + 1) * sizeof(uint32_t)) &&
+              model_file_write(file, &position, header.rule_patterns, model->rules.patterns, header.n_allowed * sizeof(uint32_t)) &&
+              model_file_write(file, &position, header.rule_masks, model->rule_masks, n_rules * model->n_words * sizeof(uint64_t));
+
+    if (fclose(file) != 0)
+        ok = false;
+    if (!ok) {
+        logger(ERROR, "Failed writing model to %s", path);
+        return WFC_IO_ERROR;
+    }
+    return WFC_OK;
+}
+
+
+WfcStatus wfc_model_load(const char *path, WfcModel **result)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        logger(ERROR, "Could not open %s", path);
+        return WFC_IO_ERROR;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ModelFileHeader)) {
+        close(fd);
+        logger(ERROR, "%s is not a compiled model", path);
+        return WFC_BAD_MODEL;
+    }
+
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        logger(ERROR, "Could not map %s", path);
+        return WFC_IO_ERROR;
+    }
+
+    // Only the header is checked: recomputing the layout from its counts
+    // must reproduce its offsets and the file size. The sections themselves
+    // are used as they are, so loading touches no more than it has to.
+    const char *base = mapping;
+    const ModelFileHeader *header = mapping;
+    ModelFileHeader expected = {
+        .pattern_size = header->pattern_size,
+        .tile_size = header->tile_size,
+        .n_patterns = header->n_patterns,
+        .n_colours = header->n_colours,
+        .n_allowed = header->n_allowed,
+    };
+    model_file_layout(&expected);
+
+    bool valid = memcmp(header->magic, WFC_MODEL_MAGIC, sizeof header->magic) == 0 &&
+                 header->version == WFC_MODEL_VERSION &&
+                 header->pattern_size > 0 && header->n_patterns > 0 &&
+                 (header->tile_size ? header->pattern_size == 1 : header->n_colours > 0) &&
+                 header->n_patterns <= UINT32_MAX && header->n_allowed <= UINT32_MAX &&
+                 expected.file_size == (uint64_t)st.st_size &&
+                 memcmp(&expected.palette, &header->palette,
+                        sizeof *header - offsetof(ModelFileHeader, palette)) == 0;
+    if (valid) {
+        const uint32_t *rule_offsets = (const uint32_t *)(base + header->rule_offsets);
+        valid = rule_offsets[header->n_patterns * N_DIRECTIONS] == header->n_allowed;
+    }
+    if (!valid) {
+        munmap(mapping, st.st_size);
+        logger(ERROR, "%s is not a compiled model of version %d", path, WFC_MODEL_VERSION);
+        return WFC_BAD_MODEL;
+    }
+
+    WfcModel *model = malloc(sizeof(WfcModel));
+    if (model == NULL) {
+        munmap(mapping, st.st_size);
+        return WFC_OUT_OF_MEMORY;
+    }
+
+    // The mapping is read-only; nothing writes through the rule pointers
+    *model = (WfcModel){
+        .pattern_size = header->pattern_size,
+        .n_patterns = header->n_patterns,
+        .n_words = bitset_words(header->n_patterns),
+        .n_colours = header->n_colours,
+        .palette = (const uint32_t *)(base + header->palette),
+        .values = header->tile_size ? NULL : (const uint8_t *)(base + header->values),
+        .tile_size = header->tile_size,
+        .tiles = header->tile_size ? (const uint32_t *)(base + header->tiles) : NULL,
+        .rules = {
+            .offsets = (uint32_t *)(base + header->rule_offsets),
+            .patterns = (uint32_t *)(base + header->rule_patterns),
+        },
+        .rule_masks = (const uint64_t *)(base + header->rule_masks),
+        .weights = (const uint32_t *)(base + header->weights),
+        .weight_log_weights = (const int64_t *)(base + header->weight_log_weights),
+        .mapping = mapping,
+        .mapping_size = st.st_size,
+    };
+    *result = model;
+    return WFC_OK;
+}
+
+
+size_t wfc_model_pattern_count(const WfcModel *model)
+{
+    return model->n_patterns;
+}
+
+
+size_t wfc_model_pattern_words(const WfcModel *model)
+{
+    return model->n_words;
+}
+
+
+void wfc_model_free(WfcModel *model)
+{
+    if (model == NULL)
+        return;
+
+    if (model->mapping) {
+        munmap(model->mapping, model->mapping_size);
+    } else {
+        free((void *)model->palette);
+        free((void *)model->values);
+        free((void *)model->tiles);
+        free((void *)model->rule_masks);
+        free((void *)model->weights);
+        free((void *)model->weight_log_weights);
+        rules_free(&model->rules);
+    }
+    free(model);
+}
+
+
+// Write output rows [first_row, first_row + n_rows) for a placement of
+// patterns on a grid_width x grid_height grid. A tiled model draws each
+// placement as its tile. pattern_nos starts at
+// placement row pattern_row, so a band of rows can be rendered on its own.
+// Each output pixel comes from the top-left value of the pattern placed at
+// the same position. Unless the grid is periodic, the last N-1 rows and
+// columns have no pattern of their own and are read from the patterns
+// covering them instead.
+internal void
+model_render_rows(const WfcModel *model, const size_t *pattern_nos, const size_t pattern_row,
+                  const size_t grid_width, const size_t grid_height, const bool periodic,
+                  const size_t first_row, const size_t n_rows, uint32_t *pixels)
+{
+    const unsigned int pattern_size = model->pattern_size;
+    const size_t output_width = periodic ? grid_width : grid_width + pattern_size - 1;
+
+    if (model->tile_size) {
+        const unsigned int tile_size = model->tile_size;
+        for (size_t y = first_row; y < first_row + n_rows; ++y) {
+            const size_t *row = pattern_nos + (y / tile_size - pattern_row) * grid_width;
+            uint32_t *out = pixels + (y - first_row) * grid_width * tile_size;
+            for (size_t i = 0; i < grid_width; ++i)
+                memcpy(out + i * tile_size, model->tiles + (row[i] * tile_size + y % tile_size) * tile_size,
+                       tile_size * sizeof(uint32_t));
+        }
+        return;
+    }
+
+    for (size_t y = first_row; y < first_row + n_rows; ++y)
+    {
+        size_t j = y < grid_height ? y : grid_height - 1;
+        const size_t *row = pattern_nos + (j - pattern_row) * grid_width;
+        uint32_t *out = pixels + (y - first_row) * output_width;
+        for (size_t x = 0; x < output_width; ++x)
+        {
+            size_t i = x < grid_width ? x : grid_width - 1;
+            const uint8_t *values = model->values + row[i] * pattern_size * pattern_size;
+            out[x] = model->palette[values[(y - j) * pattern_size + (x - i)]];
+        }
+    }
+}
+
+
+WfcStatus wfc_workspace_generate(WfcWorkspace *workspace, uint32_t *result)
+{
+    WfcStatus status = workspace_solve(workspace);
+    if (status != WFC_OK)
+        return status;
+
+    const size_t output_height = workspace->output_height;
+    model_render_rows(workspace->model, workspace->solution, 0, workspace->width, workspace->height,
+                      workspace->options.periodic_output, 0, output_height, result);
+
+#ifdef DEBUG_MODE
+    if (!workspace->options.quiet) {
+        const size_t output_width = workspace->output_width;
+        for (size_t y = 0; y < output_height; ++y)
+        {
+            putchar('\n');
+            for (size_t x = 0; x < output_width; ++x)
+            {
+                printf("%02u ", result[y * output_width + x]);
+            }
+        }
+        putchar('\n');
+    }
+#endif
+
+    return WFC_OK;
+}
+
+
+WfcStatus wfc_model_generate(const WfcModel *model, const unsigned int output_width, const unsigned int output_height,
+                             const WfcOptions *options, uint32_t *result)
+{
+    WfcWorkspace *workspace;
+    WfcStatus status = wfc_workspace_create(model, output_width, output_height, options, &workspace);
+    if (status != WFC_OK)
+        return status;
+
+    status = wfc_workspace_generate(workspace, result);
+    wfc_workspace_free(workspace);
+    return status;
+}
+
+
+WfcStatus wfc_model_generate_frame(const WfcModel *model, const WfcOptions *options, p_frame *frame)
+{
+    if (frame->width <= 0 || frame->height <= 0)
+        return WFC_BAD_INPUT;
+
+    WfcStatus status = wfc_model_generate(model, frame->width, frame->height, options, frame->pixels);
+    if (status == WFC_OK)
+        frame->changed = true;
+    return status;
+}
+
+
+WfcStatus wfc_generate(const CellGrid *grid, const unsigned int pattern_size,
+                       const unsigned int output_width, const unsigned int output_height,
+                       const WfcOptions *options, uint32_t *result)
+{
+    if (output_width < pattern_size || output_height < pattern_size)
+        return WFC_BAD_INPUT;
+
+    WfcModel *model;
+    WfcStatus status = wfc_model_compile_opts(grid, pattern_size, options, &model);
+    if (status != WFC_OK)
+        return status;
+
+    status = wfc_model_generate(model, output_width, output_height, options, result);
+    wfc_model_free(model);
+    return status;
+}
+
+
+// Add the solve counts one thread kept to the job's
+internal void
+stats_merge(WfcStats *stats, const WfcStats *part)
+{
+    stats->n_patterns = part->n_patterns;
+    stats->n_rules = part->n_rules;
+    stats->solve_ms += part->solve_ms;
+    stats->propagate_ms += part->propagate_ms;
+    stats->observe_ms += part->observe_ms;
+    stats->n_attempts += part->n_attempts;
+    stats->n_observations += part->n_observations;
+    stats->n_propagations += part->n_propagations;
+    stats->n_cells_visited += part->n_cells_visited;
+    stats->n_bans += part->n_bans;
+    stats->n_contradictions += part->n_contradictions;
+    stats->n_parallel_passes += part->n_parallel_passes;
+    if (part->peak_workspace_bytes > stats->peak_workspace_bytes)
+        stats->peak_workspace_bytes = part->peak_workspace_bytes;
+}
+
+
+typedef struct BatchShared
+{
+    const uint64_t *seeds;
+    size_t n_seeds;
+    uint32_t *const *results;
+    WfcBatchCallback callback;
+    void *context;
+
+    atomic_size_t next_index;
+    atomic_bool stopped;            // the callback asked for no more
+    pthread_mutex_t lock;
+    size_t first_failure;           // lowest failed index, n_seeds if none
+    WfcStatus failure;
+} BatchShared;
+
+
+typedef struct BatchWorker
+{
+    BatchShared *shared;
+    WfcWorkspace *workspace;
+    WfcStats stats;                 // this thread's share, when stats are wanted
+} BatchWorker;
+
+
+internal void *
+batch_worker(void *arg)
+{
+    BatchWorker *worker = arg;
+    BatchShared *shared = worker->shared;
+    WfcWorkspace *workspace = worker->workspace;
+
+    while (!atomic_load(&shared->stopped)) {
+        size_t index = atomic_fetch_add(&shared->next_index, 1);
+        if (index >= shared->n_seeds)
+            break;
+
+        workspace->options.seed = shared->seeds[index];
+        WfcStatus status = wfc_workspace_generate(workspace, shared->results[index]);
+        if (status != WFC_OK) {
+            pthread_mutex_lock(&shared->lock);
+            if (index < shared->first_failure) {
+                shared->first_failure = index;
+                shared->failure = status;
+            }
+            pthread_mutex_unlock(&shared->lock);
+        }
+        if (shared->callback && !shared->callback(shared->context, index, status))
+            atomic_store(&shared->stopped, true);
+    }
+    return NULL;
+}
+
+
+WfcStatus wfc_model_generate_batch(const WfcModel *model, const unsigned int output_width,
+                                   const unsigned int output_height, const WfcOptions *options,
+                                   const uint64_t *seeds, const size_t n_seeds, const unsigned int n_threads,
+                                   uint32_t *const *results, WfcBatchCallback callback, void *context)
+{
+    if (options->monitor)
+        return WFC_BAD_INPUT;
+
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n_workers = n_threads ? n_threads : (n_cpus > 0 ? n_cpus : 1);
+    if (n_workers > n_seeds)
+        n_workers = n_seeds;
+    if (n_workers == 0)
+        return WFC_OK;
+
+    // Every worker solves its outputs one attempt at a time, counting into
+    // stats of its own that are added up at the end
+    WfcOptions job_options = *options;
+    job_options.n_threads = 1;
+
+    BatchWorker *workers = calloc(n_workers, sizeof(BatchWorker));
+    pthread_t *threads = malloc(n_workers * sizeof(pthread_t));
+    if (workers == NULL || threads == NULL) {
+        free(workers);
+        free(threads);
+        return WFC_OUT_OF_MEMORY;
+    }
+
+    BatchShared shared = {
+        .seeds = seeds,
+        .n_seeds = n_seeds,
+        .results = results,
+        .callback = callback,
+        .context = context,
+        .first_failure = n_seeds,
+        .failure = WFC_OK,
+    };
+    atomic_init(&shared.next_index, 0);
+    atomic_init(&shared.stopped, false);
+    pthread_mutex_init(&shared.lock, NULL);
+
+    WfcStatus status = WFC_OK;
+    size_t n_ready = 0;
+    for (; n_ready < n_workers; ++n_ready) {
+        workers[n_ready].shared = &shared;
+        job_options.stats = options->stats ? &workers[n_ready].stats : NULL;
+        status = wfc_workspace_create(model, output_width, output_height, &job_options,
+                                      &workers[n_ready].workspace);
+        if (status != WFC_OK)
+            break;
+    }
+    // Carry on with fewer threads if only some workspaces fit
+    if (n_ready > 0 && status == WFC_OUT_OF_MEMORY)
+        status = WFC_OK;
+
+    if (status == WFC_OK) {
+        size_t n_started = 0;
+        for (size_t i = 1; i < n_ready; ++i) {
+            if (pthread_create(&threads[n_started], NULL, batch_worker, &workers[i]) != 0)
+                break;
+            n_started++;
+        }
+        batch_worker(&workers[0]);
+        for (size_t i = 0; i < n_started; ++i)
+            pthread_join(threads[i], NULL);
+
+        if (atomic_load(&shared.stopped) && atomic_load(&shared.next_index) < n_seeds)
+            status = WFC_CANCELLED;
+        else if (shared.first_failure < n_seeds)
+            status = shared.failure;
+    }
+
+    for (size_t i = 0; i < n_ready; ++i) {
+        if (options->stats)
+            stats_merge(options->stats, &workers[i].stats);
+        wfc_workspace_free(workers[i].workspace);
+    }
+    pthread_mutex_destroy(&shared.lock);
+    free(workers);
+    free(threads);
+    return status;
+}
+
+
+// Placements beyond a tile's right and bottom edges solved along with it
+// (and then discarded) so its edges stay continuable
+#define CHUNK_LOOKAHEAD 8
+// How many already solved tiles to the left a failed tile may take back
+// and solve again along with itself before giving up
+#define CHUNK_MAX_WIDEN 2
+
+// Placement state for chunked generation: only the current row of tiles
+// and the last placement row of the one above are ever held
+typedef struct ChunkState
+{
+    size_t grid_width, grid_height;     // whole output, in pattern positions
+    size_t tile_size;
+    size_t *band;                       // tile_size placement rows
+    size_t *above;                      // last placement row of the previous band
+    size_t *pins;                       // (tile_size + 1)^2, for one tile's wave
+    uint32_t *pixels;                   // tile_size + N - 1 output rows
+} ChunkState;
+
+
+// Solve placements [x_start, x_end) of the band starting at row y0. The
+// wave is widened by one row and column to take in the placements already
+// made above and to the left, which are pinned, and looks CHUNK_LOOKAHEAD
+// positions further right and down so the edges left for later tiles can
+// still be continued. Only the pinned row and column are kept from the
+// lookahead region's surroundings; the lookahead itself is thrown away.
+internal WfcStatus
+chunk_solve_span(WfcWorkspace *workspace, const WfcModel *model, ChunkState *chunks,
+                 const size_t x_start, const size_t x_end, const size_t y0, const WfcOptions *options)
+{
+    const size_t span_width = x_end - x_start;
+    const size_t span_height = chunks->grid_height - y0 < chunks->tile_size ? chunks->grid_height - y0 : chunks->tile_size;
+    const size_t left = x_start > 0, top = y0 > 0;
+    const size_t right_space = chunks->grid_width - x_end;
+    const size_t below_space = chunks->grid_height - y0 - span_height;
+    const size_t right = right_space < CHUNK_LOOKAHEAD ? right_space : CHUNK_LOOKAHEAD;
+    const size_t below = below_space < CHUNK_LOOKAHEAD ? below_space : CHUNK_LOOKAHEAD;
+    const size_t width = left + span_width + right, height = top + span_height + below;
+
+    WfcStatus status = wfc_workspace_reset(workspace, model, width + model->pattern_size - 1,
+                                           height + model->pattern_size - 1, options);
+    if (status != WFC_OK)
+        return status;
+
+    for (size_t v = 0; v < height; ++v) {
+        for (size_t u = 0; u < width; ++u) {
+            size_t x = x_start - left + u;
+            size_t pin = SIZE_MAX;
+            if (top && v == 0)
+                pin = chunks->above[x];
+            else if (left && u == 0 && v < top + span_height)
+                pin = chunks->band[(v - top) * chunks->grid_width + x];
+            chunks->pins[v * width + u] = pin;
+        }
+    }
+    unsigned int open_edges = (y0 - top > 0) << 0 | (x_start - left > 0) << 1 |
+                              (right < right_space) << 2 | (below < below_space) << 3;
+    for (unsigned int i = 0; i < workspace->n_waves; ++i) {
+        workspace->waves[i].pins = chunks->pins;
+        workspace->waves[i].open_edges = open_edges;
+    }
+
+    status = workspace_solve(workspace);
+    if (status != WFC_OK)
+        return status;
+
+    for (size_t v = 0; v < span_height; ++v)
+        memcpy(chunks->band + v * chunks->grid_width + x_start,
+               workspace->solution + (v + top) * width + left, span_width * sizeof(size_t));
+    return WFC_OK;
+}
+
+
+WfcStatus wfc_model_generate_chunked(const WfcModel *model, const unsigned int output_width,
+                                     const unsigned int output_height, const unsigned int tile_size,
+                                     const WfcOptions *options, WfcRowSink sink, void *context)
+{
+    const unsigned int pattern_size = model->pattern_size;
+    if (tile_size == 0 || output_width < pattern_size || output_height < pattern_size ||
+        options->periodic_output || options->constraints || model->tile_size)
+        return WFC_BAD_INPUT;
+
+    ChunkState chunks = {
+        .grid_width = output_width - (pattern_size - 1),
+        .grid_height = output_height - (pattern_size - 1),
+        .tile_size = tile_size,
+    };
+    chunks.band = malloc(chunks.tile_size * chunks.grid_width * sizeof(size_t));
+    chunks.above = malloc(chunks.grid_width * sizeof(size_t));
+    size_t max_wave_width = (CHUNK_MAX_WIDEN + 1) * chunks.tile_size + 1 + CHUNK_LOOKAHEAD;
+    size_t max_wave_height = chunks.tile_size + 1 + CHUNK_LOOKAHEAD;
+    chunks.pins = malloc(max_wave_width * max_wave_height * sizeof(size_t));
+    chunks.pixels = malloc((chunks.tile_size + pattern_size - 1) * output_width * sizeof(uint32_t));
+
+    // Every tile gets its own seed drawn from the job's, so tiles vary but
+    // the whole output still depends only on options->seed
+    WfcOptions tile_options = *options;
+    Rng seeds = {.state = options->seed ? options->seed : (uint64_t)time(NULL)};
+
+    // Sized for the widest tile; edge tiles are smaller and reuse it
+    WfcWorkspace *workspace = NULL;
+    WfcStatus status = WFC_OUT_OF_MEMORY;
+    if (chunks.band && chunks.above && chunks.pins && chunks.pixels)
+        status = wfc_workspace_create(model, max_wave_width + pattern_size - 1, max_wave_height + pattern_size - 1,
+                                      options, &workspace);
+
+    for (size_t y0 = 0; status == WFC_OK && y0 < chunks.grid_height; y0 += chunks.tile_size) {
+        for (size_t x0 = 0; status == WFC_OK && x0 < chunks.grid_width; x0 += chunks.tile_size) {
+            size_t x_end = chunks.grid_width - x0 < chunks.tile_size ? chunks.grid_width : x0 + chunks.tile_size;
+
+            // The band is still in memory, so when a tile can't be fitted
+            // to its left neighbour, solve them again together
+            status = WFC_CONTRADICTION;
+            for (size_t widen = 0; status == WFC_CONTRADICTION && widen <= CHUNK_MAX_WIDEN; ++widen) {
+                if (widen * chunks.tile_size > x0)
+                    break;
+                tile_options.seed = rng_next(&seeds) | 1;
+                status = chunk_solve_span(workspace, model, &chunks, x0 - widen * chunks.tile_size, x_end, y0,
+                                          &tile_options);
+            }
+        }
+        if (status != WFC_OK)
+            break;
+
+        // The last band also carries the N-1 rows below the final placements
+        size_t band_height = chunks.grid_height - y0 < chunks.tile_size ? chunks.grid_height - y0 : chunks.tile_size;
+        size_t n_rows = y0 + band_height == chunks.grid_height ? band_height + pattern_size - 1 : band_height;
+        model_render_rows(model, chunks.band, y0, chunks.grid_width, chunks.grid_height, false, y0, n_rows, chunks.pixels);
+        if (!sink(context, chunks.pixels, y0, n_rows))
+            status = WFC_CANCELLED;
+
+        memcpy(chunks.above, chunks.band + (band_height - 1) * chunks.grid_width, chunks.grid_width * sizeof(size_t));
+    }
+
+    wfc_workspace_free(workspace);
+    free(chunks.band);
+    free(chunks.above);
+    free(chunks.pins);
+    free(chunks.pixels);
+    return status;
+}
+
+
+bool wfc_ppm_sink(void *context, const uint32_t *pixels, const unsigned int first_row, const unsigned int n_rows)
+{
+    WfcPpmSink *ppm = context;
+    if (first_row == 0 && fprintf(ppm->file, "P6\n%u %u\n255\n", ppm->width, ppm->height) < 0)
+        return false;
+
+    for (size_t i = 0; i < (size_t)n_rows * ppm->width; ++i) {
+        uint8_t value[3] = {(pixels[i] >> 24) & 0xFF, (pixels[i] >> 16) & 0xFF, (pixels[i] >> 8) & 0xFF};
+        if (fwrite(value, sizeof(value), 1, ppm->file) != 1)
+            return false;
+    }
+    return true;
+}
+
+
+// Hierarchical generation. Each coarser level keeps every other pixel of
+// the sample and of the output, so a coarse output reads as the even pixels
+// of the next finer one. Every level is solved in square patches of
+// HIER_PATCH_SIZE placements, pinned to the placements above and to the
+// left and looking ahead as chunked generation does. A patch that fails,
+// or backtracks more than HIER_MAX_BACKTRACKS times in every attempt, is
+// solved again together with up to HIER_MAX_WIDEN patches to its left, then
+// HIER_N_RESEEDS more times with other seeds, then as many again taking
+// back the bottom HIER_RAISE rows of the patches above as well; only if all
+// of those fail does the level. A patch's pinned row reaches into the patch
+// above and to its right (the lookahead is shorter than a patch), and so
+// does that of any patch whose row it may take back, so a patch waits for
+// the one to its left and for the row above to be finished
+// HIER_MAX_WIDEN + 1 patches further right: the patches run as a skewed
+// wavefront, any that are ready side by side.
+#define HIER_PATCH_SIZE 64
+#define HIER_MAX_WIDEN  1
+#define HIER_N_RESEEDS  3
+#define HIER_RAISE      (HIER_PATCH_SIZE / 2)
+#define HIER_N_TRIES    (HIER_MAX_WIDEN + 1 + 2 * HIER_N_RESEEDS)
+#define HIER_MAX_BACKTRACKS 1024
+
+typedef struct HierShared
+{
+    const WfcModel *model;
+    const WfcOptions *options;
+    size_t grid_width, grid_height;     // in placements
+    size_t n_cols, n_rows;              // in patches
+    size_t *solution;                   // every placement of the level
+    const uint32_t *coarse;             // the coarser level's output, NULL at the coarsest
+    size_t coarse_width, coarse_height;
+
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    size_t *n_claimed, *n_done;         // per row of patches, handed out and finished
+    size_t n_left;                      // patches not finished yet
+    WfcStatus status;                   // the first failure, which stops every worker
+} HierShared;
+
+
+typedef struct HierWorker
+{
+    HierShared *shared;
+    WfcWorkspace *workspace;
+    size_t *pins;                       // sized for the largest patch window
+    bool *colour_mask;
+    uint32_t *colours;
+    WfcStats stats;                     // this thread's share, when stats are wanted
+} HierWorker;
+
+
+// Whether a coarse pixel is inside a region of one colour rather than on
+// an edge between two. Only those are held: the finer level draws its own
+// edges, which rarely fall exactly on the coarse level's.
+internal bool
+hier_coarse_settled(const HierShared *shared, const size_t x, const size_t y)
+{
+    const size_t width = shared->coarse_width, height = shared->coarse_height;
+    const uint32_t colour = shared->coarse[y * width + x];
+    return (x == 0 || shared->coarse[y * width + x - 1] == colour) &&
+           (x + 1 == width || shared->coarse[y * width + x + 1] == colour) &&
+           (y == 0 || shared->coarse[(y - 1) * width + x] == colour) &&
+           (y + 1 == height || shared->coarse[(y + 1) * width + x] == colour);
+}
+
+
+// Solve patches first_col to col of a row together into the level's
+// placements, along with the bottom raise rows of those above them. With a
+// coarser level the settled even pixels they decide are held to its
+// colours, except those next to a pinned edge, which the pins already
+// decide, and those within the lookahead of the bottom and right edges,
+// which later patches are pinned to and have to carry on from as they would
+// without guidance. If the patch can't keep to them it is solved again
+// freely, so the coarse level guides rather than binds.
+internal WfcStatus
+hier_solve_patches(HierWorker *worker, const size_t first_col, const size_t col, const size_t row,
+                   const size_t raise, const unsigned int retry)
+{
+    HierShared *shared = worker->shared;
+    WfcWorkspace *workspace = worker->workspace;
+    const WfcModel *model = shared->model;
+    const size_t n = model->pattern_size;
+    const size_t y_patch = row * HIER_PATCH_SIZE;
+    const size_t x_start = first_col * HIER_PATCH_SIZE, y_start = y_patch - raise;
+    const size_t x_end = shared->grid_width - col * HIER_PATCH_SIZE < HIER_PATCH_SIZE ? shared->grid_width
+                                                                                      : (col + 1) * HIER_PATCH_SIZE;
+    const size_t y_end = shared->grid_height - y_patch < HIER_PATCH_SIZE ? shared->grid_height : y_patch + HIER_PATCH_SIZE;
+    const size_t left = x_start > 0, top = y_start > 0;
+    const size_t right_space = shared->grid_width - x_end, below_space = shared->grid_height - y_end;
+    const size_t right = right_space < CHUNK_LOOKAHEAD ? right_space : CHUNK_LOOKAHEAD;
+    const size_t below = below_space < CHUNK_LOOKAHEAD ? below_space : CHUNK_LOOKAHEAD;
+    const size_t width = left + (x_end - x_start) + right, height = top + (y_end - y_start) + below;
+    const size_t x0 = x_start - left, y0 = y_start - top;
+
+    // Pinned: the finished placements in the window, less the rows taken
+    // back. Those run on under the lookahead to the right, where two
+    // finished patches above meet, but keep the placements the patch to the
+    // left looked ahead over and the window's last column, next to the rest
+    // of the row above.
+    for (size_t v = 0; v < height; ++v) {
+        for (size_t u = 0; u < width; ++u) {
+            const size_t x = x0 + u, y = y0 + v;
+            bool pinned = y < y_patch || (x < x_start && y < y_end);
+            if (pinned && x >= x_start && y >= y_start)
+                pinned = (left && x < x_start + CHUNK_LOOKAHEAD) || (u + 1 == width && right < right_space);
+            worker->pins[v * width + u] = pinned ? shared->solution[y * shared->grid_width + x] : SIZE_MAX;
+        }
+    }
+    unsigned int open_edges = (y0 > 0) << 0 | (x0 > 0) << 1 | (right < right_space) << 2 | (below < below_space) << 3;
+
+    size_t n_held = 0;
+    if (shared->coarse) {
+        const size_t output_width = width + n - 1, output_height = height + n - 1;
+        const size_t x_first = x_start + (left ? n - 1 : 0), y_first = y_start + (top ? n - 1 : 0);
+        for (size_t v = 0; v < output_height; ++v) {
+            for (size_t u = 0; u < output_width; ++u) {
+                size_t x = x0 + u, y = y0 + v;
+                bool held = x % 2 == 0 && y % 2 == 0 && x >= x_first && x + CHUNK_LOOKAHEAD < x_end &&
+                            y >= y_first && y + CHUNK_LOOKAHEAD < y_end && hier_coarse_settled(shared, x / 2, y / 2);
+                worker->colour_mask[v * output_width + u] = held;
+                if (held) {
+                    worker->colours[v * output_width + u] = shared->coarse[(y / 2) * shared->coarse_width + x / 2];
+                    n_held++;
+                }
+            }
+        }
+    }
+
+    // Seeded by position, so the output doesn't depend on which thread
+    // took the patch or when
+    WfcOptions options = *shared->options;
+    Rng seeds = rng_stream(shared->options->seed, (row * shared->n_cols + col) * HIER_N_TRIES + retry);
+    WfcConstraints anchors = {.colour_mask = worker->colour_mask, .colours = worker->colours};
+    options.seed = rng_next(&seeds) | 1;
+    options.n_threads = 1;
+    options.constraints = n_held ? &anchors : NULL;
+    // One quick try at keeping to the coarser level, giving up at the first
+    // contradiction; the patch's attempts and backtracking are for solving
+    // it freely if that fails
+    if (n_held) {
+        options.max_attempts = 1;
+        options.recovery = WFC_RECOVER_RESTART;
+    }
+    options.stats = shared->options->stats ? &worker->stats : NULL;
+    // Past this a patch is better solved again with more room than
+    // searched further
+    if (options.max_backtracks == 0 || options.max_backtracks > HIER_MAX_BACKTRACKS)
+        options.max_backtracks = HIER_MAX_BACKTRACKS;
+
+    WfcStatus status;
+    for (;;) {
+        status = wfc_workspace_reset(workspace, model, width + n - 1, height + n - 1, &options);
+        if (status != WFC_OK)
+            return status;
+        for (unsigned int i = 0; i < workspace->n_waves; ++i) {
+            workspace->waves[i].pins = worker->pins;
+            workspace->waves[i].open_edges = open_edges;
+        }
+
+        status = workspace_solve(workspace);
+        if (status != WFC_CONTRADICTION || options.constraints == NULL)
+            break;
+        if (!options.quiet)
+            logger(DEBUG, "WFC patch (%zu, %zu) can't follow the coarser level, solving it freely", col, row);
+        options.constraints = NULL;
+        options.max_attempts = shared->options->max_attempts;
+        options.recovery = shared->options->recovery;
+    }
+    if (status != WFC_OK)
+        return status;
+
+    for (size_t v = 0; v < y_end - y_start; ++v)
+        memcpy(shared->solution + (y_start + v) * shared->grid_width + x_start,
+               workspace->solution + (v + top) * width + left,
+               ((v < raise ? x_end + right : x_end) - x_start) * sizeof(size_t));
+    return WFC_OK;
+}
+
+
+// Wait for a patch whose left neighbour and row above are finished far
+// enough and claim it. False once every patch is finished or one has failed.
+internal bool
+hier_claim(HierShared *shared, size_t *col, size_t *row)
+{
+    bool claimed = false;
+    pthread_mutex_lock(&shared->lock);
+    while (!claimed && shared->status == WFC_OK && shared->n_left > 0) {
+        for (size_t r = 0; r < shared->n_rows && !claimed; ++r) {
+            size_t c = shared->n_claimed[r];
+            size_t above = c + HIER_MAX_WIDEN + 2 < shared->n_cols ? c + HIER_MAX_WIDEN + 2 : shared->n_cols;
+            if (c < shared->n_cols && shared->n_done[r] == c && (r == 0 || shared->n_done[r - 1] >= above)) {
+                shared->n_claimed[r]++;
+                *col = c;
+                *row = r;
+                claimed = true;
+            }
+        }
+        if (!claimed)
+            pthread_cond_wait(&shared->progress, &shared->lock);
+    }
+    pthread_mutex_unlock(&shared->lock);
+    return claimed;
+}
+
+
+internal void *
+hier_worker(void *arg)
+{
+    HierWorker *worker = arg;
+    HierShared *shared = worker->shared;
+
+    size_t col, row;
+    while (hier_claim(shared, &col, &row)) {
+        const size_t max_widen = col < HIER_MAX_WIDEN ? col : HIER_MAX_WIDEN;
+        const size_t max_raise = row > 0 ? HIER_RAISE : 0;
+        WfcStatus status = WFC_CONTRADICTION;
+        for (unsigned int retry = 0; status == WFC_CONTRADICTION && retry < HIER_N_TRIES; ++retry) {
+            const size_t widen = retry < max_widen ? retry : max_widen;
+            const size_t raise = retry > HIER_MAX_WIDEN + HIER_N_RESEEDS ? max_raise : 0;
+            status = hier_solve_patches(worker, col - widen, col, row, raise, retry);
+        }
+        pthread_mutex_lock(&shared->lock);
+        if (status != WFC_OK && shared->status == WFC_OK)
+            shared->status = status;
+        shared->n_done[row]++;
+        shared->n_left--;
+        pthread_cond_broadcast(&shared->progress);
+        pthread_mutex_unlock(&shared->lock);
+    }
+    return NULL;
+}
+
+
+// Solve one level in patches, guided by the coarser level's output (half
+// the size, rounded up) if there is one
+internal WfcStatus
+hier_solve_level(const WfcModel *model, const unsigned int output_width, const unsigned int output_height,
+                 const uint32_t *coarse, const WfcOptions *options, uint32_t *result)
+{
+    const size_t n = model->pattern_size;
+    HierShared shared = {
+        .model = model,
+        .options = options,
+        .grid_width = output_width - (n - 1),
+        .grid_height = output_height - (n - 1),
+        .coarse = coarse,
+        .coarse_width = (output_width + 1) / 2,
+        .coarse_height = (output_height + 1) / 2,
+        .status = WFC_OK,
+    };
+    shared.n_cols = (shared.grid_width + HIER_PATCH_SIZE - 1) / HIER_PATCH_SIZE;
+    shared.n_rows = (shared.grid_height + HIER_PATCH_SIZE - 1) / HIER_PATCH_SIZE;
+    shared.n_left = shared.n_cols * shared.n_rows;
+
+    // No more patches are ever ready at once than fit on one skewed diagonal
+    const size_t skew = HIER_MAX_WIDEN + 2;
+    size_t n_workers = options->n_threads > 1 ? options->n_threads : 1;
+    size_t widest = (shared.n_cols + skew - 1) / skew < shared.n_rows ? (shared.n_cols + skew - 1) / skew : shared.n_rows;
+    if (n_workers > widest)
+        n_workers = widest;
+
+    shared.solution = malloc(shared.grid_width * shared.grid_height * sizeof(size_t));
+    shared.n_claimed = calloc(shared.n_rows, sizeof(size_t));
+    shared.n_done = calloc(shared.n_rows, sizeof(size_t));
+    HierWorker *workers = calloc(n_workers, sizeof(HierWorker));
+    pthread_t *threads = malloc(n_workers * sizeof(pthread_t));
+
+    // Workspaces sized for the largest window, with room for the coarse
+    // colours when there are any
+    size_t max_width = (HIER_MAX_WIDEN + 1) * HIER_PATCH_SIZE + 1 + CHUNK_LOOKAHEAD;
+    size_t max_height = HIER_RAISE + HIER_PATCH_SIZE + 1 + CHUNK_LOOKAHEAD;
+    if (max_width > shared.grid_width)
+        max_width = shared.grid_width;
+    if (max_height > shared.grid_height)
+        max_height = shared.grid_height;
+    const size_t max_pixels = (max_width + n - 1) * (max_height + n - 1);
+    WfcConstraints sizing = {0};
+    WfcOptions job_options = *options;
+    job_options.n_threads = 1;
+    job_options.constraints = coarse ? &sizing : NULL;
+
+    WfcStatus status = WFC_OUT_OF_MEMORY;
+    size_t n_ready = 0;
+    if (shared.solution && shared.n_claimed && shared.n_done && workers && threads) {
+        for (; n_ready < n_workers; ++n_ready) {
+            HierWorker *worker = &workers[n_ready];
+            worker->shared = &shared;
+            worker->pins = malloc(max_width * max_height * sizeof(size_t));
+            if (coarse) {
+                worker->colour_mask = malloc(max_pixels * sizeof(bool));
+                worker->colours = malloc(max_pixels * sizeof(uint32_t));
+            }
+            if (worker->pins == NULL || (coarse && (worker->colour_mask == NULL || worker->colours == NULL))) {
+                status = WFC_OUT_OF_MEMORY;
+                break;
+            }
+            job_options.stats = options->stats ? &worker->stats : NULL;
+            status = wfc_workspace_create(model, max_width + n - 1, max_height + n - 1, &job_options,
+                                          &worker->workspace);
+            if (status != WFC_OK)
+                break;
+        }
+        // Carry on with fewer threads if only some workers fit
+        if (n_ready > 0 && status == WFC_OUT_OF_MEMORY)
+            status = WFC_OK;
+    }
+
+    if (status == WFC_OK) {
+        pthread_mutex_init(&shared.lock, NULL);
+        pthread_cond_init(&shared.progress, NULL);
+
+        size_t n_started = 0;
+        for (size_t i = 1; i < n_ready; ++i) {
+            if (pthread_create(&threads[n_started], NULL, hier_worker, &workers[i]) != 0)
+                break;
+            n_started++;
+        }
+        hier_worker(&workers[0]);
+        for (size_t i = 0; i < n_started; ++i)
+            pthread_join(threads[i], NULL);
+
+        pthread_cond_destroy(&shared.progress);
+        pthread_mutex_destroy(&shared.lock);
+        status = shared.status;
+    }
+
+    if (status == WFC_OK)
+        model_render_rows(model, shared.solution, 0, shared.grid_width, shared.grid_height, false, 0,
+                          output_height, result);
+
+    // The loop above may have stopped partway through a worker
+    for (size_t i = 0; workers && i < n_workers; ++i) {
+        if (options->stats && workers[i].workspace)
+            stats_merge(options->stats, &workers[i].stats);
+        wfc_workspace_free(workers[i].workspace);
+        free(workers[i].pins);
+        free(workers[i].colour_mask);
+        free(workers[i].colours);
+    }
+    free(workers);
+    free(threads);
+    free(shared.solution);
+    free(shared.n_claimed);
+    free(shared.n_done);
+    return status;
+}
+
+
+// Solve the coarser levels first, then this one guided by them. A coarse
+// level that can't be solved leaves this one unguided rather than failing.
+internal WfcStatus
+hier_generate_level(const CellGrid *grid, const unsigned int pattern_size, const unsigned int output_width,
+                    const unsigned int output_height, const unsigned int n_levels, const WfcOptions *options,
+                    uint32_t *result)
+{
+    const unsigned int coarse_width = (output_width + 1) / 2, coarse_height = (output_height + 1) / 2;
+    CellGrid half = {.rows = (grid->rows + 1) / 2, .cols = (grid->cols + 1) / 2};
+    uint32_t *coarse = NULL;
+    WfcStatus status = WFC_OK;
+
+    if (n_levels > 1 && half.rows >= pattern_size && half.cols >= pattern_size &&
+        coarse_width >= pattern_size && coarse_height >= pattern_size) {
+        half.cells = malloc((size_t)half.rows * half.cols * sizeof(uint32_t));
+        coarse = malloc((size_t)coarse_width * coarse_height * sizeof(uint32_t));
+        if (half.cells == NULL || coarse == NULL) {
+            status = WFC_OUT_OF_MEMORY;
+        } else {
+            for (size_t y = 0; y < half.rows; ++y)
+                for (size_t x = 0; x < half.cols; ++x)
+                    half.cells[y * half.cols + x] = grid->cells[2 * y * grid->cols + 2 * x];
+
+            // A seed of its own, so the levels don't make the same choices
+            WfcOptions coarse_options = *options;
+            Rng rng = {.state = options->seed};
+            coarse_options.seed = rng_next(&rng) | 1;
+            status = hier_generate_level(&half, pattern_size, coarse_width, coarse_height, n_levels - 1,
+                                         &coarse_options, coarse);
+        }
+        free(half.cells);
+
+        if (status == WFC_CONTRADICTION) {
+            if (!options->quiet)
+                logger(DEBUG, "WFC level of %ux%u failed, solving %ux%u unguided", coarse_width, coarse_height,
+                       output_width, output_height);
+            free(coarse);
+            coarse = NULL;
+            status = WFC_OK;
+        }
+    }
+
+    // Compiling sets the stats' compile times, so this level's are added to
+    // those of the levels already built instead of replacing them
+    WfcModel *model = NULL;
+    if (status == WFC_OK) {
+        const double extract_ms = options->stats ? options->stats->extract_ms : 0;
+        const double rules_ms = options->stats ? options->stats->rules_ms : 0;
+        status = wfc_model_compile_opts(grid, pattern_size, options, &model);
+        if (options->stats) {
+            options->stats->extract_ms += extract_ms;
+            options->stats->rules_ms += rules_ms;
+        }
+    }
+    if (status == WFC_OK)
+        status = hier_solve_level(model, output_width, output_height, coarse, options, result);
+
+    wfc_model_free(model);
+    free(coarse);
+    return status;
+}
+
+
+WfcStatus wfc_generate_hierarchical(const CellGrid *grid, const unsigned int pattern_size,
+                                    const unsigned int output_width, const unsigned int output_height,
+                                    const unsigned int n_levels, const WfcOptions *options, uint32_t *result)
+{
+    if (n_levels == 0 || output_width < pattern_size || output_height < pattern_size ||
+        options->periodic_output || options->constraints || options->monitor)
+        return WFC_BAD_INPUT;
+
+    WfcOptions job_options = *options;
+    if (job_options.seed == 0)
+        job_options.seed = (uint64_t)time(NULL);
+    return hier_generate_level(grid, pattern_size, output_width, output_height, n_levels, &job_options, result);
+}
+
+
+
+// Incremental editing: a session keeps the solved placements of a whole
+// output and repairs only the part the caller changed. A re-solve covers
+// the changed placements plus SESSION_MARGIN around them, held in place by
+// a ring of the current placements just outside; each time that fails the
+// margin doubles, until the window is the whole output.
+#define SESSION_MARGIN 4
+
+struct WfcSession
+{
+    const WfcModel *model;
+    WfcOptions options;
+    Rng seeds;                      // a fresh seed for every window solved
+    size_t width, height;           // output grid, in pattern positions
+    size_t *solution;               // current placement of every position
+    bool *pinned;                   // held through re-solves
+    bool *dirty;                    // cleared, waiting for a re-solve
+    size_t *pins;                   // for one window's wave
+    WfcWorkspace *workspace;        // sized for the whole output
+};
+
+
+// Output pixels spanned by n placements in a row or column
+internal size_t
+model_output_extent(const WfcModel *model, const size_t n)
+{
+    return model->tile_size ? n * model->tile_size : n + model->pattern_size - 1;
+}
+
+
+// Solve placements [x0, x1) x [y0, y1) with the ring around them, and
+// whatever is pinned inside, held to the current solution
+internal WfcStatus
+session_solve_window(WfcSession *session, const size_t x0, const size_t y0, const size_t x1, const size_t y1)
+{
+    const size_t left = x0 > 0, top = y0 > 0;
+    const size_t right = x1 < session->width, below = y1 < session->height;
+    const size_t width = left + (x1 - x0) + right, height = top + (y1 - y0) + below;
+
+    session->options.seed = rng_next(&session->seeds) | 1;
+    WfcWorkspace *workspace = session->workspace;
+    WfcStatus status = wfc_workspace_reset(workspace, session->model, model_output_extent(session->model, width),
+                                           model_output_extent(session->model, height), &session->options);
+    if (status != WFC_OK)
+        return status;
+
+    for (size_t v = 0; v < height; ++v) {
+        for (size_t u = 0; u < width; ++u) {
+            size_t i = (y0 - top + v) * session->width + (x0 - left + u);
+            bool ring = u < left || u >= width - right || v < top || v >= height - below;
+            session->pins[v * width + u] = ring || session->pinned[i] ? session->solution[i] : SIZE_MAX;
+        }
+    }
+    unsigned int open_edges = (y0 - top > 0) << 0 | (x0 - left > 0) << 1 |
+                              (x1 + right < session->width) << 2 | (y1 + below < session->height) << 3;
+    for (unsigned int i = 0; i < workspace->n_waves; ++i) {
+        workspace->waves[i].pins = session->pins;
+        workspace->waves[i].open_edges = open_edges;
+    }
+
+    status = workspace_solve(workspace);
+    if (status != WFC_OK)
+        return status;
+
+    for (size_t v = 0; v < y1 - y0; ++v)
+        memcpy(session->solution + (y0 + v) * session->width + x0,
+               workspace->solution + (v + top) * width + left, (x1 - x0) * sizeof(size_t));
+    return WFC_OK;
+}
+
+
+WfcStatus wfc_session_create(const WfcModel *model, const unsigned int output_width, const unsigned int output_height,
+                             const WfcOptions *options, WfcSession **result)
+{
+    if (options->periodic_output || options->constraints)
+        return WFC_BAD_INPUT;
+
+    WfcSession *session = calloc(1, sizeof(WfcSession));
+    if (session == NULL)
+        return WFC_OUT_OF_MEMORY;
+
+    WfcStatus status = wfc_workspace_create(model, output_width, output_height, options, &session->workspace);
+    if (status != WFC_OK) {
+        free(session);
+        return status;
+    }
+
+    session->model = model;
+    session->options = *options;
+    session->seeds.state = options->seed ? options->seed : (uint64_t)time(NULL);
+    session->width = session->workspace->width;
+    session->height = session->workspace->height;
+
+    size_t size = session->width * session->height;
+    session->solution = malloc(size * sizeof(size_t));
+    session->pinned = calloc(size, sizeof(bool));
+    session->dirty = calloc(size, sizeof(bool));
+    session->pins = malloc(size * sizeof(size_t));
+    if (!session->solution || !session->pinned || !session->dirty || !session->pins) {
+        wfc_session_free(session);
+        return WFC_OUT_OF_MEMORY;
+    }
+
+    // Nothing is placed yet, so the first solve is of everything
+    memset(session->dirty, true, size * sizeof(bool));
+    status = wfc_session_resolve(session);
+    if (status != WFC_OK) {
+        wfc_session_free(session);
+        return status;
+    }
+    *result = session;
+    return WFC_OK;
+}
+
+
+void wfc_session_free(WfcSession *session)
+{
+    if (session == NULL)
+        return;
+    wfc_workspace_free(session->workspace);
+    free(session->solution);
+    free(session->pinned);
+    free(session->dirty);
+    free(session->pins);
+    free(session);
+}
+
+
+// Clip an output pixel rectangle to the placements owning its pixels:
+// the one at the same position, or for a tiled model the tile under it.
+// Returns false if nothing is left.
+internal bool
+session_clip(const WfcSession *session, const int x, const int y, const int width, const int height,
+             size_t *x0, size_t *y0, size_t *x1, size_t *y1)
+{
+    const long tile_size = session->model->tile_size ? session->model->tile_size : 1;
+    long left = x > 0 ? x : 0, top = y > 0 ? y : 0;
+    long right = (long)x + width, bottom = (long)y + height;
+    if (right <= left || bottom <= top)
+        return false;
+
+    // Ceiling division, so a partly covered tile counts
+    *x0 = left / tile_size;
+    *y0 = top / tile_size;
+    *x1 = (right + tile_size - 1) / tile_size;
+    *y1 = (bottom + tile_size - 1) / tile_size;
+    if (*x1 > session->width)
+        *x1 = session->width;
+    if (*y1 > session->height)
+        *y1 = session->height;
+    // The last N-1 pixel rows and columns are drawn by the last placements
+    if (*x0 >= session->width)
+        *x0 = session->width - 1;
+    if (*y0 >= session->height)
+        *y0 = session->height - 1;
+    if (*x1 <= *x0)
+        *x1 = *x0 + 1;
+    if (*y1 <= *y0)
+        *y1 = *y0 + 1;
+    return true;
+}
+
+
+internal void
+session_mark(WfcSession *session, const int x, const int y, const int width, const int height,
+             const bool pinned, const bool dirty)
+{
+    size_t x0, y0, x1, y1;
+    if (!session_clip(session, x, y, width, height, &x0, &y0, &x1, &y1))
+        return;
+    for (size_t v = y0; v < y1; ++v) {
+        for (size_t u = x0; u < x1; ++u) {
+            session->pinned[v * session->width + u] = pinned;
+            session->dirty[v * session->width + u] = dirty;
+        }
+    }
+}
+
+
+void wfc_session_pin(WfcSession *session, const int x, const int y, const int width, const int height)
+{
+    session_mark(session, x, y, width, height, true, false);
+}
+
+
+void wfc_session_unpin(WfcSession *session, const int x, const int y, const int width, const int height)
+{
+    session_mark(session, x, y, width, height, false, false);
+}
+
+
+void wfc_session_clear(WfcSession *session, const int x, const int y, const int width, const int height)
+{
+    session_mark(session, x, y, width, height, false, true);
+}
+
+
+WfcStatus wfc_session_resolve(WfcSession *session)
+{
+    size_t x0 = SIZE_MAX, y0 = SIZE_MAX, x1 = 0, y1 = 0;
+    for (size_t v = 0; v < session->height; ++v) {
+        for (size_t u = 0; u < session->width; ++u) {
+            if (!session->dirty[v * session->width + u])
+                continue;
+            x0 = u < x0 ? u : x0;
+            y0 = v < y0 ? v : y0;
+            x1 = u + 1 > x1 ? u + 1 : x1;
+            y1 = v + 1 > y1 ? v + 1 : y1;
+        }
+    }
+    if (x1 == 0)
+        return WFC_OK;
+
+    WfcStatus status;
+    for (size_t margin = SESSION_MARGIN; ; margin *= 2) {
+        size_t wx0 = x0 > margin ? x0 - margin : 0;
+        size_t wy0 = y0 > margin ? y0 - margin : 0;
+        size_t wx1 = session->width - x1 > margin ? x1 + margin : session->width;
+        size_t wy1 = session->height - y1 > margin ? y1 + margin : session->height;
+
+        status = session_solve_window(session, wx0, wy0, wx1, wy1);
+        bool whole = wx0 == 0 && wy0 == 0 && wx1 == session->width && wy1 == session->height;
+        if (status == WFC_OK) {
+            for (size_t v = wy0; v < wy1; ++v)
+                memset(session->dirty + v * session->width + wx0, false, (wx1 - wx0) * sizeof(bool));
+            break;
+        }
+        if (whole || (status != WFC_CONTRADICTION && status != WFC_TIMEOUT))
+            break;
+    }
+    return status;
+}
+
+
+void wfc_session_render(const WfcSession *session, uint32_t *result)
+{
+    model_render_rows(session->model, session->solution, 0, session->width, session->height, false,
+                      0, model_output_extent(session->model, session->height), result);
+}
@@ -2,7 +2,11 @@
 #define _H_WAVE
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+
+#include "pictoro.h"
 
 typedef struct CellGrid
 {
@@ -12,30 +16,333 @@ typedef struct CellGrid
 } CellGrid;
 
 
+typedef enum WfcPropagator
+{
+    WFC_PROPAGATE_BITSET,   // rebuild neighbour support from per-pattern rule bitmasks
+    WFC_PROPAGATE_AC4,      // keep per-pattern support counters, O(1) work per ban
+    WFC_PROPAGATE_PARALLEL  // bitset propagation, with large cascades split over horizontal
+                            // bands of the output on n_propagation_threads threads;
+                            // gives the same results as WFC_PROPAGATE_BITSET
+} WfcPropagator;
+
+typedef enum WfcRecovery
+{
+    WFC_RECOVER_NONE,       // give up on the first contradiction
+    WFC_RECOVER_RESTART,    // start over from a fresh wave, keeping the patterns and rules
+    WFC_RECOVER_BACKTRACK   // take back observations until the contradiction goes away,
+                            // restarting if that runs out
+} WfcRecovery;
+
+typedef enum WfcStatus
+{
+    WFC_OK = 0,
+    WFC_CONTRADICTION,      // every allowed attempt ended in a contradiction
+    WFC_TIMEOUT,            // time_limit_ms ran out first
+    WFC_BAD_INPUT,          // sample or output smaller than the pattern size, or unsupported options
+    WFC_OUT_OF_MEMORY,
+    WFC_CANCELLED,          // abandoned because another attempt finished first
+    WFC_IO_ERROR,           // a model file could not be read or written
+    WFC_BAD_MODEL           // a model file has the wrong format or version
+} WfcStatus;
+
+
+// Parts of the output fixed before generation starts: required colours for
+// some pixels and/or restricted pattern sets for some placements. Either
+// layer may be left NULL. Placements are laid out as the solver sees them:
+// (output_width - N + 1) x (output_height - N + 1) for a sampled model, one
+// per pixel for a periodic output, and one per tile for a tiled model,
+// whose patterns are its tiles in the order given.
+typedef struct WfcConstraints
+{
+    const bool *colour_mask;        // output_width * output_height, pixels to hold
+    const uint32_t *colours;        // colour each held pixel must be
+    const bool *pattern_mask;       // one per placement, placements to restrict
+    const uint64_t *patterns;       // wfc_model_pattern_words(model) words of allowed patterns per placement
+} WfcConstraints;
+
+
+// Watching a solve from another thread. While wfc_model_generate (or
+// wfc_workspace_generate) runs with a monitor in its options, the solver
+// publishes a preview of the attempt in progress at most every interval_ms:
+// each output pixel the average colour of the patterns still possible
+// there. The reader takes the latest with wfc_monitor_preview, which never
+// waits on the solver. Sized for one output; chunked generation and
+// sessions don't take one.
+typedef struct WfcMonitor WfcMonitor;
+
+
+// What a job cost. Compiling a sample sets the model fields. Generating
+// sets the pattern and rule counts too, and adds everything else to what is
+// already there, so chunked generation and sessions total every window they
+// solve; zero the struct to start a fresh count. Times spent in parallel
+// attempts add up, so they can exceed solve_ms.
+typedef struct WfcStats
+{
+    size_t n_patterns;
+    size_t n_rules;                 // allowed (pattern, direction, neighbour) triples
+    double extract_ms;              // palette and pattern extraction
+    double rules_ms;                // adjacency rules, rule masks and weights
+
+    double solve_ms;                // all attempts, wall clock
+    double propagate_ms;            // including backtracking
+    double observe_ms;
+    unsigned int n_attempts;
+    uint64_t n_observations;
+    uint64_t n_propagations;        // cells (bans, for AC-4) whose removals were passed on to their neighbours
+    uint64_t n_cells_visited;       // neighbouring cells those re-checked
+    uint64_t n_bans;                // patterns removed from cells
+    uint64_t n_contradictions;      // including those backtracked out of
+    uint64_t n_parallel_passes;     // cascades handed to WFC_PROPAGATE_PARALLEL's bands
+    size_t peak_workspace_bytes;
+} WfcStats;
+
+
+// Zero-initialised options are valid: bitset propagation, no recovery,
+// a clock-derived seed, a single thread, the four rotations of each sample
+// window and no wrapping at the edges
+typedef struct WfcOptions
+{
+    WfcPropagator propagator;
+    WfcRecovery recovery;
+    unsigned int max_attempts;      // attempts including the first, 0 for the default
+    unsigned int max_backtracks;    // per attempt, 0 for no limit
+    unsigned int time_limit_ms;     // across all attempts, 0 for no limit
+    uint64_t seed;                  // same seed, same output; 0 to seed from the clock
+    unsigned int n_threads;         // run attempts concurrently, 0 or 1 for the calling thread only
+    unsigned int n_propagation_threads; // bands for WFC_PROPAGATE_PARALLEL, 0 for one per CPU
+    unsigned int parallel_threshold;    // cells a cascade revisits serially before the bands take it, 0 for the default
+
+    // Compiling a model: which variants of every sample window are patterns
+    // too (1 the window only, 2 its mirror image, 4 its rotations, 8 the
+    // rotations mirrored as well; 0 for 4), and whether windows wrap around
+    // the sample's edges
+    unsigned int symmetry;
+    bool periodic_input;
+    // The output wraps around, so copies of it tile seamlessly. Propagation
+    // is then serial even with WFC_PROPAGATE_PARALLEL, and chunked
+    // generation is not supported.
+    bool periodic_output;
+    // Applied and propagated once before the first observation; a job
+    // whose constraints can't all hold fails with WFC_CONTRADICTION.
+    // Chunked generation and sessions don't take them.
+    const WfcConstraints *constraints;
+    WfcMonitor *monitor;            // NULL for none
+    WfcStats *stats;                // NULL for none
+    // No logging from the solver, and no output grid dump in debug builds:
+    // nothing on stdout while generating
+    bool quiet;
+} WfcOptions;
+
+
+// A sample compiled into a palette, patterns, weights and adjacency rules.
+// Compile once and generate from it any number of times, or save it and
+// map it back in later without rebuilding anything. Samples may use at most
+// 256 distinct colours.
+typedef struct WfcModel WfcModel;
+
+WfcStatus wfc_model_compile(const CellGrid *grid, const unsigned int pattern_size, WfcModel **model);
+// Uses only the symmetry and periodic_input options
+WfcStatus wfc_model_compile_opts(const CellGrid *grid, const unsigned int pattern_size,
+                                 const WfcOptions *options, WfcModel **model);
+WfcStatus wfc_model_save(const WfcModel *model, const char *path);
+// The simple tiled model: instead of patterns found in a sample, a fixed
+// set of square tiles with weights and the pairs of tiles that may sit next
+// to each other. The compiled model shares the solver with sampled ones;
+// its outputs are sized in pixels, and must be whole numbers of tiles.
+typedef struct WfcTileNeighbour
+{
+    unsigned int first, second;     // second may sit right of first, or below it if vertical
+    bool vertical;
+} WfcTileNeighbour;
+
+typedef struct WfcTileset
+{
+    unsigned int n_tiles, tile_size;
+    const uint32_t *pixels;         // n_tiles * tile_size^2, a tile at a time, each row-major
+    const uint32_t *weights;        // relative frequency of each tile (non-zero); NULL for equal
+    const WfcTileNeighbour *neighbours;
+    size_t n_neighbours;
+} WfcTileset;
+
+WfcStatus wfc_tiled_model_compile(const WfcTileset *tileset, WfcModel **model);
+
+// Map a saved model read-only. Files use the byte order of the machine
+// that saved them.
+WfcStatus wfc_model_load(const char *path, WfcModel **model);
+void wfc_model_free(WfcModel *model);
+size_t wfc_model_pattern_count(const WfcModel *model);
+// 64-bit words in a set of the model's patterns, as WfcConstraints takes
+size_t wfc_model_pattern_words(const WfcModel *model);
+
+// Fills result (output_width * output_height pixels, row-major) only when
+// WFC_OK is returned. Allocates a workspace for the call.
+WfcStatus wfc_model_generate(const WfcModel *model, const unsigned int output_width, const unsigned int output_height,
+                             const WfcOptions *options, uint32_t *result);
+// Generate output the size of frame straight into its pixels
+WfcStatus wfc_model_generate_frame(const WfcModel *model, const WfcOptions *options, p_frame *frame);
+// All the solver state for one model, output size and set of options, made
+// as a single allocation up front. Check the footprint (in bytes, 0 if the
+// job is invalid) against a memory budget before creating one; reset it to
+// run another job that fits, or the same one with a new seed, without
+// allocating again.
+typedef struct WfcWorkspace WfcWorkspace;
+
+size_t wfc_workspace_footprint(const WfcModel *model, const unsigned int output_width,
+                               const unsigned int output_height, const WfcOptions *options);
+WfcStatus wfc_workspace_create(const WfcModel *model, const unsigned int output_width,
+                               const unsigned int output_height, const WfcOptions *options,
+                               WfcWorkspace **workspace);
+// WFC_OUT_OF_MEMORY if the new job needs more than the workspace holds
+WfcStatus wfc_workspace_reset(WfcWorkspace *workspace, const WfcModel *model, const unsigned int output_width,
+                              const unsigned int output_height, const WfcOptions *options);
+void wfc_workspace_free(WfcWorkspace *workspace);
+WfcStatus wfc_workspace_generate(WfcWorkspace *workspace, uint32_t *result);
+
+// Told when output index (made with seeds[index]) is done; its buffer holds
+// the output if status is WFC_OK. Called on the batch's threads, several at
+// once and in no particular order. Return false to start no more outputs.
+typedef bool (*WfcBatchCallback)(void *context, size_t index, WfcStatus status);
+
+// One output per seed from the same model, written into results[index]
+// (output_width * output_height pixels each). n_threads threads (0 for one
+// per CPU) each take whole outputs with a workspace of their own, so
+// options->n_threads is ignored and each output is as if generated alone
+// with its seed. callback may be NULL. Returns WFC_CANCELLED if the
+// callback stopped the batch, otherwise the status of the lowest-numbered
+// output that failed, or WFC_OK. Takes no monitor.
+WfcStatus wfc_model_generate_batch(const WfcModel *model, const unsigned int output_width,
+                                   const unsigned int output_height, const WfcOptions *options,
+                                   const uint64_t *seeds, const size_t n_seeds, const unsigned int n_threads,
+                                   uint32_t *const *results, WfcBatchCallback callback, void *context);
+
+// Receives finished output rows top to bottom: n_rows rows of output_width
+// pixels, starting at first_row. Return false to stop generation.
+typedef bool (*WfcRowSink)(void *context, const uint32_t *pixels, unsigned int first_row, unsigned int n_rows);
+
+// Generate in tile_size x tile_size chunks (in pattern positions), a row of
+// tiles at a time, handing each finished band of rows to sink. Each tile is
+// solved with the placements bordering it above and to the left pinned, so
+// memory stays proportional to one row of tiles however tall the output is.
+// Attempts, backtracking and time_limit_ms apply to each tile separately.
+// Returns WFC_CANCELLED if the sink stops it. Not for tiled models or
+// constrained outputs.
+WfcStatus wfc_model_generate_chunked(const WfcModel *model, const unsigned int output_width,
+                                     const unsigned int output_height, const unsigned int tile_size,
+                                     const WfcOptions *options, WfcRowSink sink, void *context);
+
+// A WfcRowSink writing a binary PPM (as pictoro_save_frame does) to file
+typedef struct WfcPpmSink
+{
+    FILE *file;
+    unsigned int width, height;
+} WfcPpmSink;
+
+bool wfc_ppm_sink(void *context, const uint32_t *pixels, const unsigned int first_row, const unsigned int n_rows);
+
+// An output kept solved while the caller edits it. Rectangles are in output
+// pixels and select the placements drawing them. Pinned placements keep
+// their patterns through re-solves; cleared ones are solved again by the
+// next wfc_session_resolve, which repairs only a window around them and
+// widens it if that fails. A failed re-solve leaves the output as it was,
+// still marked for repair. Not for periodic or constrained outputs; pin
+// placements instead.
+typedef struct WfcSession WfcSession;
+
+// Solves the whole output before returning
+WfcStatus wfc_session_create(const WfcModel *model, const unsigned int output_width, const unsigned int output_height,
+                             const WfcOptions *options, WfcSession **session);
+void wfc_session_free(WfcSession *session);
+void wfc_session_pin(WfcSession *session, const int x, const int y, const int width, const int height);
+void wfc_session_unpin(WfcSession *session, const int x, const int y, const int width, const int height);
+void wfc_session_clear(WfcSession *session, const int x, const int y, const int width, const int height);
+WfcStatus wfc_session_resolve(WfcSession *session);
+// Draw the current output (output_width * output_height pixels)
+void wfc_session_render(const WfcSession *session, uint32_t *result);
+
+WfcStatus wfc_monitor_create(const unsigned int output_width, const unsigned int output_height,
+                             const unsigned int interval_ms, WfcMonitor **monitor);
+void wfc_monitor_free(WfcMonitor *monitor);
+// Make the solve return WFC_CANCELLED at its next observation. Cancelling
+// sticks, so a monitor is for one solve.
+void wfc_monitor_cancel(WfcMonitor *monitor);
+// The latest preview (output_width * output_height pixels), or NULL before
+// the first. Stays valid until the next call, from a single reader thread.
+const uint32_t *wfc_monitor_preview(WfcMonitor *monitor);
+
+// Compile the sample and generate from it in one go
+WfcStatus wfc_generate(const CellGrid *grid, const unsigned int pattern_size,
+                       const unsigned int output_width, const unsigned int output_height,
+                       const WfcOptions *options, uint32_t *result);
+
+// Coarse to fine, for large outputs. The sample and the output are halved
+// n_levels - 1 times by keeping every other pixel (stopping early once
+// either would be smaller than a pattern), and the smallest level is solved
+// first. Each finer level then holds its even pixels to the colours the
+// level below chose, so the layout is settled where the search is cheap
+// and only detail is left to fill in. Levels are solved in patches pinned
+// to their neighbours above and to the left, as chunked generation does,
+// and n_threads threads solve the patches that are ready side by side. A
+// patch that can't keep to the coarser level is solved again without it; one
+// that still fails is solved again with its neighbours to the left, with
+// other seeds and then with the bottom of the row above before the level
+// gives up, and a coarser level that fails outright just leaves the next
+// unguided. Attempts, backtracking (capped per patch, so a stuck patch
+// moves on to those retries) and time_limit_ms apply to each patch. The
+// output depends on options->seed alone, not on the number of threads. Not
+// for periodic outputs; takes no constraints or monitor. Every level's
+// compile times are added to options->stats along with the solving.
+WfcStatus wfc_generate_hierarchical(const CellGrid *grid, const unsigned int pattern_size,
+                                    const unsigned int output_width, const unsigned int output_height,
+                                    const unsigned int n_levels, const WfcOptions *options, uint32_t *result);
+const char *wfc_status_string(const WfcStatus status);
+
+// Return a malloc'd output, or NULL if generation failed
 uint32_t *run_wfc_algo(const CellGrid *grid, const unsigned int pattern_size, const unsigned int output_width, const unsigned int output_height);
+uint32_t *run_wfc_algo_opts(const CellGrid *grid, const unsigned int pattern_size, 
+                            const unsigned int output_width, const unsigned int output_height,
+                            const WfcOptions *options);
 
 
 #ifdef _UNIT_TEST
 
 
+typedef struct IndexedGrid
+{
+    uint8_t *cells;
+    unsigned int rows, cols;
+    unsigned int index_bits;
+} IndexedGrid;
+
 typedef struct Pattern
 {
-    uint32_t *values;
+    uint8_t *values;
+    uint64_t key;
     unsigned int count;
 } Pattern;
 
-typedef struct PatternList
+typedef struct KeyLayout KeyLayout;
+
+typedef struct KeyKernels
 {
-    size_t *patterns;
-    unsigned int count, capacity;
-} PatternList;
+    uint64_t (*pack)(const KeyLayout *layout, const uint8_t *values);
+    void (*unpack)(const KeyLayout *layout, uint64_t key, uint8_t *values);
+    uint64_t (*rotate)(const KeyLayout *layout, const uint64_t key);
+    uint64_t (*reflect)(const KeyLayout *layout, const uint64_t key);
+} KeyKernels;
+
+struct KeyLayout
+{
+    unsigned int pattern_size, index_bits;
+    uint64_t top_mask;
+    uint64_t left_mask;
+    const KeyKernels *kernels;
+};
+
+extern const KeyKernels key_kernels_generic;
 
-bool pattern_equals(Pattern first, Pattern second, int pattern_size);
-void pattern_copy(Pattern *const dest, const Pattern *const src, const int pattern_size);
-bool pattern_in_list(Pattern *const new, Pattern *const patterns, const size_t pattern_count, const size_t pattern_size);
-int generate_patterns(const CellGrid *const grid, const unsigned int max_patterns, const unsigned int pattern_size, Pattern **results);
-bool check_vertical_match(uint32_t *top, uint32_t *bottom, int pattern_size);
-bool check_horizontal_match(uint32_t *left, uint32_t *right, int pattern_size);
+int generate_patterns(const IndexedGrid *const grid, const unsigned int pattern_size, const unsigned int symmetry,
+                      const bool periodic, Pattern **results);
+bool key_layout_init(KeyLayout *layout, const unsigned int pattern_size, const unsigned int index_bits);
 
 #endif  // _UNIT_TEST
 #endif  // _H_WAVE
\ No newline at end of file